@@ -167,6 +167,28 @@ int open_net(client_t * client)
 	return sock;
 }
 
+/* 
+ * function add_server(): add a server to the block device, tell the
+ *          kernel module about its version and capabilities if possible
+ * returns: result of ioctl, name is set to the ioctl used last
+ */
+int add_server(client_t * client, struct dnbd_server_info *server,
+	       const char **name)
+{
+	int result;
+
+	if (server->version > 0) {
+		*name = "DNBD_SET_SERVER";
+		result = ioctl(client->dnbd, DNBD_SET_SERVER, server);
+		/* kernel module of version 0 does not know the ioctl */
+		if ((result == 0) || (errno != EINVAL))
+			return result;
+	}
+
+	*name = "DNBD_SET_SERVERID";
+	return ioctl(client->dnbd, DNBD_SET_SERVERID, server->id);
+}
+
 /* 
  * function do_handshake(): send init requests to the network and wait for 
  *          server replies
@@ -178,10 +200,12 @@ int do_handshake(client_t * client)
 	struct pollfd read_fds[1];
 	struct dnbd_request request;
 	int replylen;
-	struct dnbd_reply_init reply_init;
+	struct dnbd_reply_init_ext reply_init;
+	struct dnbd_server_info server;
 	time_t starttime, stoptime;
 	int cycle = 1;
 	int servers = 0;
+	const char *name;
 
 	client->capacity = 0;
 	client->blksize = 0;
@@ -193,8 +217,13 @@ int do_handshake(client_t * client)
 
 	/* request comes from a client and is addressed to all servers */
 	request.magic = htonl(DNBD_MAGIC);
-	request.cmd = htons(DNBD_CMD_INIT | DNBD_CMD_CLI);
+	request.cmd = htons(DNBD_CMD_INIT | DNBD_CMD_CLI | DNBD_CMD_EXT);
 	request.id = htons(0);	/* ask all servers */
+	request.time = htons(0);
+	request.len = htons(0);
+
+	/* tell servers what we can do, servers of version 0 ignore it */
+	request.pos = htonll(DNBD_EXT_POS(DNBD_PROTO_VERSION, DNBD_CAPS));
 
 	/* send requests (in 1 second intervals) */ 
 	/* and wait DNBD_TIMEOUT seconds for replies */
@@ -225,10 +254,11 @@ int do_handshake(client_t * client)
 		/* handle reply */
 		replylen =
 		    recv(client->sock, &reply_init,
-			 sizeof(struct dnbd_reply_init), MSG_WAITALL);
+			 sizeof(struct dnbd_reply_init_ext), MSG_WAITALL);
 			
-		/* check for integrity */
-		if (replylen != sizeof(struct dnbd_reply_init))
+		/* check for integrity, servers of version 0 send less */
+		if ((replylen != sizeof(struct dnbd_reply_init))
+		    && (replylen != sizeof(struct dnbd_reply_init_ext)))
 			continue;
 		reply_init.magic = ntohl(reply_init.magic);
 		if (reply_init.magic != DNBD_MAGIC) {
@@ -236,7 +266,8 @@ int do_handshake(client_t * client)
 		}
 		reply_init.cmd = ntohs(reply_init.cmd);
 		if (!((reply_init.cmd & DNBD_CMD_SRV) &&
-		      ((reply_init.cmd & DNBD_CMD_MASK) == DNBD_CMD_INIT)))
+		      (((reply_init.cmd & DNBD_CMD_MASK) == DNBD_CMD_INIT) ||
+		       ((reply_init.cmd & DNBD_CMD_MASK) == DNBD_CMD_BEACON))))
 			continue;
 
 		/* copy parameters of block device from reply */
@@ -244,25 +275,40 @@ int do_handshake(client_t * client)
 		reply_init.capacity = ntohll(reply_init.capacity);
 		reply_init.blksize = ntohs(reply_init.blksize);
 
+		server.id = reply_init.id;
+		if (replylen == sizeof(struct dnbd_reply_init_ext)) {
+			server.version = ntohs(reply_init.version);
+			server.caps = ntohl(reply_init.caps) & DNBD_CAPS;
+			server.xfersize = ntohl(reply_init.xfersize);
+		} else {
+			server.version = 0;
+			server.caps = 0;
+			server.xfersize = DNBD_XFER_MIN;
+		}
+
 		/* add server to block device servers */
-		if ((result =
-		     ioctl(client->dnbd, DNBD_SET_SERVERID,
-			   reply_init.id)) < 0) {
-			if (errno == EEXIST)
-				continue;
-			else
+		if ((result = add_server(client, &server, &name)) < 0) {
+			if (errno != EEXIST) {
 				fprintf(stderr,
-					"ERROR: ioctl DNBD_SET_SERVERID failed!\n");
-			return -EINVAL;
+					"ERROR: ioctl %s failed!\n", name);
+				return -EINVAL;
+			}
 		} else {
-			printf("* Added server with id %i\n",
-			       reply_init.id);
+			printf("* Added server with id %i (version %i)\n",
+			       server.id, server.version);
 
 			client->capacity = reply_init.capacity;
 			client->blksize = reply_init.blksize;
 			servers++;
 		}
 
+		/* 
+		   servers sending beacons need no waiting, the kernel
+		   module adds further ones from their beacons 
+		 */
+		if ((reply_init.cmd & DNBD_CMD_MASK) == DNBD_CMD_BEACON)
+			cycle = 0;
+
 	}
 
 	/* check, if servers have been found */
@@ -14,8 +14,10 @@
 /* host byte order <-> network byte order */
 #if __BYTE_ORDER == __BIG_ENDIAN
 #define ntohll(x) (x)
+#define htonll(x) (x)
 #else
 #define ntohll(x) bswap_64(x)
+#define htonll(x) bswap_64(x)
 #endif
 
 #else
@@ -26,6 +28,7 @@
 
 /* some constants */
 #define		DNBD_VERSION		"0.9.0"
+#define		DNBD_PROTO_VERSION	1	/* 0.9.0 peers have 0 */
 #define		DNBD_PORT		5001
 #define		DNBD_MAGIC		0x19051979
 #define 	DNBD_MAJOR 		0
@@ -46,15 +49,65 @@
 #define DNBD_SET_CACHE		_IO( DNBD_IOCTL_TYPE, 5)
 #define DNBD_DO_IT		_IO( DNBD_IOCTL_TYPE, 6)
 #define DNBD_DISCONNECT		_IO( DNBD_IOCTL_TYPE, 7)
+#define DNBD_SET_SERVER		_IO( DNBD_IOCTL_TYPE, 8)
 
 /* define communication between server and client */
 #define DNBD_CMD_MASK		0x07
 #define DNBD_CMD_INIT		0x01
 #define DNBD_CMD_READ		0x02
 #define DNBD_CMD_HB		0x03
+#define DNBD_CMD_BUSY		0x04
+#define DNBD_CMD_FEC		0x05	/* parity of preceding datagrams */
+#define DNBD_CMD_LZ4		0x06	/* read reply with compressed data */
+#define DNBD_CMD_BEACON		0x07	/* periodic struct dnbd_reply_init_ext
+					   of a server without request */
+#define DNBD_CMD_NACK		0x04	/* request: datagrams with sequence
+					   numbers pos + i for bit i in map
+					   of struct dnbd_request_map lost */
 
 #define DNBD_CMD_CLI		0x08
 #define DNBD_CMD_SRV		0x10
+#define DNBD_CMD_SECTORS	0x20	/* request length in sectors */
+#define DNBD_CMD_MORE		0x40	/* more fragments of reply follow */
+#define DNBD_CMD_EXT		0x80	/* init/heartbeat request carries
+					   version and capabilities in pos,
+					   reply is struct dnbd_reply_init_ext */
+#define DNBD_CMD_MAP		0x100	/* read request is struct
+					   dnbd_request_map */
+#define DNBD_CMD_SEQ		0x200	/* reply ends with sequence number */
+#define DNBD_CMD_USEC		0x400	/* request ends with timestamp in
+					   microseconds, its replies end
+					   with the same one */
+#define DNBD_CMD_LOAD		0x800	/* reply ends with load of server */
+#define DNBD_CMD_PUSH		0x1000	/* data sent without a request */
+
+/* capabilities exchanged during handshake */
+#define DNBD_CAP_XFER		(1<<0)	/* requests larger than 4 KiB */
+#define DNBD_CAP_MAP		(1<<1)	/* multi-block read requests */
+#define DNBD_CAP_LZ4		(1<<2)	/* LZ4 compressed read replies */
+#define DNBD_CAP_SEQ		(1<<3)	/* sequence numbers and NACKs */
+#define DNBD_CAP_USEC		(1<<4)	/* timestamps in microseconds */
+#define DNBD_CAP_LOAD		(1<<5)	/* load sent with replies */
+
+/* capabilities of this release */
+#define DNBD_CAPS		(DNBD_CAP_XFER | DNBD_CAP_MAP | DNBD_CAP_LZ4 | \
+				 DNBD_CAP_SEQ | DNBD_CAP_USEC | DNBD_CAP_LOAD)
+
+/* pos field of init and heartbeat requests */
+#define DNBD_EXT_POS(version, caps) \
+	(((uint64_t) (version) << 32) | (uint32_t) (caps))
+#define DNBD_EXT_VERSION(pos)	((uint16_t) ((pos) >> 32))
+#define DNBD_EXT_CAPS(pos)	((uint32_t) (pos))
+
+/* limits of bytes per read request */
+#define DNBD_XFER_MIN		4096	/* supported by all servers */
+#define DNBD_XFER_MAX		65536
+
+/* blocks covered by a multi-block read request */
+#define DNBD_MAP_BLOCKS		64
+
+/* maximum of datagrams protected by a parity datagram */
+#define DNBD_FEC_MAX		16
 
 #define DNBD_TMR_OUT		0x0a
 
@@ -70,6 +123,23 @@ struct dnbd_request {
 };
 #pragma pack()
 
+/* 
+ * multi-block read request: bit i of map asks for len bytes at
+ * pos + i * len, contiguous blocks are answered as a single reply
+ * whose datagrams all have DNBD_CMD_MORE set except the last one
+ */
+#pragma pack(1)
+struct dnbd_request_map {
+	uint32_t magic;
+	uint16_t id;
+	uint16_t cmd;
+	uint64_t pos;
+	uint16_t time;
+	uint16_t len;
+	uint64_t map;
+};
+#pragma pack()
+
 #pragma pack(1)
 struct dnbd_reply {
 	uint32_t magic;
@@ -80,6 +150,24 @@ struct dnbd_reply {
 };
 #pragma pack()
 
+/* 
+ * flags of replies with a trailer (DNBD_CMD_SEQ, ...) append it after
+ * the data in order of the flag bits; clients of version 0.9 copy only
+ * whole segments and ignore these few bytes
+ */
+typedef uint32_t dnbd_trailer_seq_t;
+typedef uint32_t dnbd_trailer_usec_t;
+
+#pragma pack(1)
+struct dnbd_trailer_load {
+	uint16_t depth;		/* number of pending requests */
+	uint16_t service;	/* average microseconds to read 4 KiB */
+	uint8_t hits;		/* percentage of reads served from memory */
+};
+#pragma pack()
+
+typedef struct dnbd_trailer_load dnbd_trailer_load_t;
+
 #pragma pack(1)
 struct dnbd_reply_init {
 	uint32_t magic;
@@ -91,13 +179,91 @@ struct dnbd_reply_init {
 };
 #pragma pack()
 
+/* 
+ * heartbeat replies and replies to init requests with DNBD_CMD_EXT
+ * carry additional server parameters
+ */
+#pragma pack(1)
+struct dnbd_reply_init_ext {
+	uint32_t magic;
+	uint16_t id;
+	uint16_t cmd;
+	uint64_t capacity;
+	uint16_t time;
+	uint16_t blksize;
+	uint32_t xfersize;	/* maximum bytes per read request */
+	uint16_t version;	/* protocol version of server */
+	uint32_t caps;		/* capabilities of server */
+};
+#pragma pack()
+
+/* sent instead of data when the server is overloaded */
+#pragma pack(1)
+struct dnbd_reply_busy {
+	uint32_t magic;
+	uint16_t id;
+	uint16_t cmd;
+	uint64_t pos;
+	uint16_t time;
+	uint16_t depth;		/* number of pending requests */
+};
+#pragma pack()
+
+/* 
+ * XOR parity of count datagrams of a reply, starting at pos, each of
+ * size bytes except the last one of the group, which ends at pos + len;
+ * DNBD_CMD_MORE is set when the last one of the group has it set,
+ * with DNBD_CMD_SEQ the size bytes of parity are followed by the
+ * sequence numbers of the count datagrams
+ */
+#pragma pack(1)
+struct dnbd_reply_fec {
+	uint32_t magic;
+	uint16_t id;
+	uint16_t cmd;
+	uint64_t pos;
+	uint16_t time;
+	uint16_t count;
+	uint32_t size;
+	uint32_t len;
+};
+#pragma pack()
+
+/* 
+ * datagram of a read reply compressed as LZ4 block, sent instead of
+ * the plain one to clients which announced DNBD_CAP_LZ4
+ */
+#pragma pack(1)
+struct dnbd_reply_lz4 {
+	uint32_t magic;
+	uint16_t id;
+	uint16_t cmd;
+	uint64_t pos;
+	uint16_t time;
+	uint16_t len;		/* bytes of data when expanded */
+};
+#pragma pack()
+
 typedef struct dnbd_reply dnbd_reply_t;
 typedef struct dnbd_reply_init dnbd_reply_init_t;
+typedef struct dnbd_reply_init_ext dnbd_reply_init_ext_t;
+typedef struct dnbd_reply_busy dnbd_reply_busy_t;
+typedef struct dnbd_reply_fec dnbd_reply_fec_t;
+typedef struct dnbd_reply_lz4 dnbd_reply_lz4_t;
 typedef struct dnbd_request dnbd_request_t;
+typedef struct dnbd_request_map dnbd_request_map_t;
 	
 struct dnbd_file {
 	const char *name;
 	int len;
 };
 
+/* server parameters found during handshake */
+struct dnbd_server_info {
+	uint16_t id;
+	uint16_t version;
+	uint32_t caps;
+	uint32_t xfersize;
+};
+
 #endif /* LINUX_DNBD_CLISERV_H */
@@ -8,6 +8,9 @@
 #include <linux/highmem.h>
 #include <linux/fs.h>
 #include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/hash.h>
 /* use red-black library of kernel */
 #include <linux/rbtree.h>
 #include <asm/uaccess.h>
@@ -69,11 +72,15 @@ int dnbd_cache_search(dnbd_cache_t * cache, struct request *req)
 	}
 	/* block is not cached */
 	cache->miss++;
-	goto out;
+	up(&cache->sema);
+	return 0;
 
-	/* cached block was found */
+	/* cached block was found, it is not reused while it is read */
       found:
 	cache->hits++;
+	atomic_inc(&cn->users);
+	up(&cache->sema);
+
 	offset = cn->rb_data * blksize;
 	rq_for_each_bio(bio, req) {
 		bio_for_each_segment(bvec, bio, i) {
@@ -107,156 +114,287 @@ int dnbd_cache_search(dnbd_cache_t * cache, struct request *req)
 	}
 
       out:
-	up(&cache->sema);
+	atomic_dec(&cn->users);
 
 	/* return number of copied sectors */
 	return result >> 9;
 }
 
-int dnbd_cache_insert(dnbd_cache_t * cache, sector_t sector, void *buf)
+/* remove node from LRU list */
+static void dnbd_cache_lru_del(dnbd_cache_t * cache, cache_node_t * cn)
 {
-	mm_segment_t old_fs = get_fs();
-	int result = 0;
-	struct rb_node **p;
-	struct rb_node *parent = NULL;
-	cache_node_t *__cn, *cn;
-	sector_t act_block;
+	if (cn->prev)
+		cn->prev->next = cn->next;
+	else
+		cache->head = cn->next;
+
+	if (cn->next)
+		cn->next->prev = cn->prev;
+	else
+		cache->tail = cn->prev;
+}
 
-	loff_t offset;
+/* insert node to head of LRU list */
+static void dnbd_cache_lru_add(dnbd_cache_t * cache, cache_node_t * cn)
+{
+	cn->prev = NULL;
+	cn->next = cache->head;
 
-	down(&cache->sema);
-	p = &cache->root.rb_node;
+	if (cache->head)
+		cache->head->prev = cn;
+	cache->head = cn;
+
+	if (!cache->tail)
+		cache->tail = cn;
+}
+
+/* 
+ * reserve a block of the cache file for a sector, returns NULL if the
+ * sector is cached already or no block is available
+ */
+static cache_node_t *dnbd_cache_reserve(dnbd_cache_t * cache,
+					sector_t sector)
+{
+	struct rb_node *n = cache->root.rb_node;
+	cache_node_t *cn;
+
+	while (n) {
+		cn = rb_entry_cn(n);
+		if (sector < cn->rb_key)
+			n = n->rb_left;
+		else if (sector > cn->rb_key)
+			n = n->rb_right;
+		else {
+			/* the sector was already added to cache */
+			if (cn != cache->head) {
+				dnbd_cache_lru_del(cache, cn);
+				dnbd_cache_lru_add(cache, cn);
+				cache->lru++;
+			}
+			return NULL;
+		}
+	}
+
+	/* blocks of failed writes first, then unused ones, then LRU node */
+	if ((cn = cache->free))
+		cache->free = cn->next;
+	else if (cache->used_blocks < cache->max_blocks) {
+		if (!(cn = (cache_node_t *) kmalloc(sizeof(cache_node_t),
+						    GFP_KERNEL)))
+			return NULL;
+		cn->rb_data = cache->used_blocks++;
+		atomic_set(&cn->users, 0);
+	} else {
+		/* blocks being read by searches are skipped */
+		for (cn = cache->tail; cn && atomic_read(&cn->users);
+		     cn = cn->prev);
+		if (!cn)
+			return NULL;
+		/* 
+		   the node is erased from the tree, so its block is not
+		   found by searches while it is overwritten
+		 */
+		dnbd_cache_lru_del(cache, cn);
+		rb_erase(&cn->rb_node, &cache->root);
+	}
+
+	cn->rb_key = sector;
+	return cn;
+}
+
+/* add node of a written block to tree and LRU list */
+static void dnbd_cache_link(dnbd_cache_t * cache, cache_node_t * cn)
+{
+	struct rb_node **p = &cache->root.rb_node;
+	struct rb_node *parent = NULL;
 
-	/* red-black tree search and replacement in O(log n) */
-	
-	/* check if node was already inserted to cache and,
-	   if necessary, do LRU replacement */
-	
 	while (*p) {
 		parent = *p;
-		__cn = rb_entry_cn(parent);
-		if (sector < __cn->rb_key)
+		if (cn->rb_key < rb_entry_cn(parent)->rb_key)
 			p = &(*p)->rb_left;
-		else if (sector > __cn->rb_key)
+		else
 			p = &(*p)->rb_right;
-		else {
-			/* the sector was already added to cache */
+	}
 
-			/* LRU replacement policy */
-			if (__cn->prev)
-				__cn->prev->next = __cn->next;
-			else
-				/* __cn is head - do nothing */
-				goto no_lru;
+	/* call kernel helpers for red-black trees */
+	rb_link_node(&cn->rb_node, parent, p);
+	rb_insert_color(&cn->rb_node, &cache->root);
 
-			if (__cn->next)
-				__cn->next->prev = __cn->prev;
-			else
-				/* __cn is tail - so set new one */
-				cache->tail =
-				    (__cn->prev ? __cn->prev : __cn);
+	dnbd_cache_lru_add(cache, cn);
+}
 
-			/* insert new node to head:
-			   head of list has no predecessor, 
-			   set previous node to NULL and next 
-			   node to old head and set new head */
+/* write blocks at consecutive positions of the cache file at once */
+static void dnbd_cache_writev(dnbd_cache_t * cache, struct cache_fill **run,
+			      int n)
+{
+	mm_segment_t old_fs = get_fs();
+	struct iovec iov[CACHE_FILL_BATCH];
+	loff_t offset = (loff_t) run[0]->node->rb_data * cache->blksize;
+	ssize_t result;
+	int i;
 
-			__cn->prev = NULL;
-			__cn->next = cache->head;
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = run[i]->data;
+		iov[i].iov_len = cache->blksize;
+	}
+
+	set_fs(get_ds());
+	result = vfs_writev(cache->filp, iov, n, &offset);
+	set_fs(old_fs);
 
-			if (cache->head)
-				cache->head->prev = __cn;
+	if (result == n * cache->blksize)
+		return;
 
-			cache->head = __cn;
+	printk("dnbd: ERROR writing to cache!\n");
 
-			cache->lru++;
-		      no_lru:
-			result = 1;
-			goto out;
-		}
+	/* keep blocks for following fills */
+	down(&cache->sema);
+	for (i = 0; i < n; i++) {
+		run[i]->node->next = cache->free;
+		cache->free = run[i]->node;
+		run[i]->node = NULL;
 	}
+	up(&cache->sema);
+}
 
-	/* check if cache is full */
-	if (cache->used_blocks == cache->max_blocks) {
-		/* 
-		   remove LRU node (cn), but keep reserved 
-		   data structure in memory 
-		*/
-		cn = cache->tail;
-		cache->tail->prev->next = NULL;
-		cache->tail = cache->tail->prev;
-
-		/*
-		   Node (which is tail of LRU list) will be erased from tree 
-		   which is then rebalanced. 
-		   Re-finding a parent for the a node is mandatory.
-		 */
-		act_block = cn->rb_data;
-		rb_erase(&cn->rb_node, &cache->root);
-		p = &cache->root.rb_node;
-		while (*p) {
-			parent = *p;
-			__cn = rb_entry_cn(parent);
-			if (sector < __cn->rb_key)
-				p = &(*p)->rb_left;
-			else
-				p = &(*p)->rb_right;
-		}
-	} else {
-		/* cache is not full, so reserve memory for red-black tree node */
-		if (!
-		    (cn =
-		     (cache_node_t *) kmalloc(sizeof(cache_node_t),
-					      GFP_KERNEL))) {
-			result = -ENOMEM;
-			goto out;
+/* write blocks waiting for the cache file, called by work queue */
+static void dnbd_cache_fill(void *data)
+{
+	dnbd_cache_t *cache = data;
+	struct cache_fill *fill, *run[CACHE_FILL_BATCH];
+	int n = 0;
+	LIST_HEAD(batch);
+
+	spin_lock(&cache->lock);
+	list_splice_init(&cache->fill_pending, &batch);
+	memset(cache->fill_hash, 0, sizeof(cache->fill_hash));
+	spin_unlock(&cache->lock);
+
+	/* reserve blocks of cache file, cached sectors are only refreshed */
+	down(&cache->sema);
+	list_for_each_entry(fill, &batch, list) {
+		fill->node = dnbd_cache_reserve(cache, fill->sector);
+	}
+	up(&cache->sema);
+
+	/* searches are not held up while blocks are written */
+	list_for_each_entry(fill, &batch, list) {
+		if (!fill->node)
+			continue;
+		if (n && ((n == CACHE_FILL_BATCH)
+			  || (fill->node->rb_data !=
+			      run[n - 1]->node->rb_data + 1))) {
+			dnbd_cache_writev(cache, run, n);
+			n = 0;
 		}
-		act_block = cache->used_blocks;
-		/* cn = &cache->nodes[act_block]; */
-		cache->used_blocks++;
+		run[n++] = fill;
 	}
-	
-	/* write block to cache file */	
-	offset = act_block * cache->blksize;
-	set_fs(get_ds());
-	result = vfs_write(cache->filp, buf, cache->blksize, &offset);
-	set_fs(old_fs);
+	if (n)
+		dnbd_cache_writev(cache, run, n);
 
-	if (result != cache->blksize) {
-		printk("dnbd: ERROR writing to cache!\n");
-		cache->used_blocks--;
-		kfree(cn);
-		goto out;
+	/* written blocks are found by searches from now on */
+	down(&cache->sema);
+	list_for_each_entry(fill, &batch, list) {
+		if (fill->node)
+			dnbd_cache_link(cache, fill->node);
 	}
-	
-	/* cn (current node) points to an empty node, now */
-	cn->rb_key = sector;
-	cn->rb_data = act_block;
+	up(&cache->sema);
 
-	/* current node (which will become the new head) has no predecessor */
-	cn->prev = NULL;
-	cn->next = cache->head;
+	spin_lock(&cache->lock);
+	list_splice(&batch, &cache->fill_free);
+	spin_unlock(&cache->lock);
+}
 
-	/* adapt head element - if it exists */
-	if (cache->head)
-		cache->head->prev = cn;
+/* 
+ * queue a block for the cache file, the caller does not wait for the
+ * write and the block is dropped if too many blocks wait already
+ */
+int dnbd_cache_insert(dnbd_cache_t * cache, sector_t sector, void *buf)
+{
+	struct cache_fill *fill, **chain;
+	int result = 0;
 
-	/* set new head */
-	cache->head = cn;
+	spin_lock(&cache->lock);
 
-	/* set new tail */
-	if (!cache->tail)
-		cache->tail = cn;
+	/* the sector waits already */
+	chain = &cache->fill_hash[hash_long((unsigned long) sector,
+					    CACHE_FILL_HASH_BITS)];
+	for (fill = *chain; fill; fill = fill->hash_next) {
+		if (fill->sector == sector)
+			goto out;
+	}
 
-	/* call kernel helpers for red-black trees */
-	rb_link_node(&cn->rb_node, parent, p);
-	rb_insert_color(&cn->rb_node, &cache->root);
+	if (list_empty(&cache->fill_free)) {
+		cache->dropped++;
+		result = -EBUSY;
+		goto out;
+	}
+
+	fill = list_entry(cache->fill_free.next, struct cache_fill, list);
+	memcpy(fill->data, buf, cache->blksize);
+	fill->sector = sector;
+	fill->hash_next = *chain;
+	*chain = fill;
+	list_move_tail(&fill->list, &cache->fill_pending);
 
       out:
-	up(&cache->sema);
+	spin_unlock(&cache->lock);
+
+	if (!result)
+		queue_work(cache->fill_wq, &cache->fill_work);
 	return result;
 }
 
+/* free blocks waiting for the cache file after they are written */
+static void dnbd_cache_fill_free(dnbd_cache_t * cache)
+{
+	int i;
+
+	if (cache->fill_wq) {
+		destroy_workqueue(cache->fill_wq);
+		cache->fill_wq = NULL;
+	}
+
+	if (cache->fills) {
+		for (i = 0; i < CACHE_FILL_MAX; i++)
+			kfree(cache->fills[i].data);
+		kfree(cache->fills);
+		cache->fills = NULL;
+	}
+
+	INIT_LIST_HEAD(&cache->fill_free);
+	INIT_LIST_HEAD(&cache->fill_pending);
+	memset(cache->fill_hash, 0, sizeof(cache->fill_hash));
+}
+
+/* reserve blocks waiting for the cache file and the queue writing them */
+static int dnbd_cache_fill_alloc(dnbd_cache_t * cache)
+{
+	int i;
+
+	if (!(cache->fills = kmalloc(CACHE_FILL_MAX * sizeof(*cache->fills),
+				     GFP_KERNEL)))
+		return -ENOMEM;
+
+	memset(cache->fills, 0, CACHE_FILL_MAX * sizeof(*cache->fills));
+
+	for (i = 0; i < CACHE_FILL_MAX; i++) {
+		if (!(cache->fills[i].data = kmalloc(cache->blksize,
+						     GFP_KERNEL)))
+			goto out_free;
+		list_add_tail(&cache->fills[i].list, &cache->fill_free);
+	}
+
+	if (!(cache->fill_wq = create_singlethread_workqueue("dnbd-cache")))
+		goto out_free;
+
+	return 0;
+
+      out_free:
+	dnbd_cache_fill_free(cache);
+	return -ENOMEM;
+}
+
 int dnbd_cache_init(dnbd_cache_t * cache)
 {
 	int result = -EINVAL;
@@ -278,15 +416,24 @@ int dnbd_cache_init(dnbd_cache_t * cache)
 	cache->hits = 0;
 	cache->miss = 0;
 	cache->lru = 0;
+	cache->dropped = 0;
 
 	cache->filp = NULL;
 	cache->fname = NULL;
 
 	cache->head = NULL;
 	cache->tail = NULL;
+	cache->free = NULL;
 	spin_lock_init(&cache->lock);
 	init_MUTEX(&cache->sema);
 
+	cache->fills = NULL;
+	cache->fill_wq = NULL;
+	INIT_LIST_HEAD(&cache->fill_free);
+	INIT_LIST_HEAD(&cache->fill_pending);
+	memset(cache->fill_hash, 0, sizeof(cache->fill_hash));
+	INIT_WORK(&cache->fill_work, dnbd_cache_fill, cache);
+
 	result = 0;
 	return result;
 }
@@ -297,11 +444,18 @@ void dnbd_cache_clean(dnbd_cache_t * cache)
 	cache_node_t *tmp;
 	int cnt = 0;
 
+	/* write blocks still waiting before their nodes are freed */
+	if (cache->fill_wq)
+		flush_workqueue(cache->fill_wq);
+	dnbd_cache_fill_free(cache);
+
 	spin_lock(&cache->lock);
 	node = cache->head;
 
 	cache->head = NULL;
 	cache->tail = NULL;
+	cache->root.rb_node = NULL;
+	cache->used_blocks = 0;
 
 	if (cache->fname)
 		kfree(cache->fname);
@@ -313,9 +467,17 @@ void dnbd_cache_clean(dnbd_cache_t * cache)
 		kfree(tmp);
 		cnt++;
 	}
+	while ((tmp = cache->free)) {
+		cache->free = tmp->next;
+		kfree(tmp);
+		cnt++;
+	}
 	printk(KERN_INFO "dnbd: freed %i cache nodes\n", cnt);
 
 	cache->active = 0;
+	cache->insert = &dnbd_cache_dummy_insert;
+	cache->search = &dnbd_cache_dummy_search;
+	cache->clean = &dnbd_cache_dummy_clean;
 	spin_unlock(&cache->lock);
 
 }
@@ -371,6 +533,9 @@ int dnbd_cache_set(dnbd_cache_t * cache, struct dnbd_file __user * arg,
 	cache->max_blocks = div1;
 	cache->blksize = blksize;
 
+	if ((result = dnbd_cache_fill_alloc(cache)) < 0)
+		goto out_free;
+
 	/* activate cache and adapt function for insert, search and clean up */
 	cache->active = 1;
 	cache->insert = &dnbd_cache_insert;
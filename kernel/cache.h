@@ -3,6 +3,8 @@
 
 #include <linux/rbtree.h>
 #include <linux/blkdev.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
 
 #include "../common/dnbd-cliserv.h"
 
@@ -11,6 +13,7 @@ struct cache_node {
 	struct rb_node rb_node;
 	sector_t rb_key;
 	sector_t rb_data;
+	atomic_t users;			/* searches reading the block */
 	/* previous and next node used for LRU */
 	struct cache_node *prev;
 	struct cache_node *next;
@@ -18,6 +21,23 @@ struct cache_node {
 
 typedef struct cache_node cache_node_t;
 
+/* blocks waiting to be written to the cache file, more are dropped */
+#define CACHE_FILL_MAX		256
+/* blocks written to the cache file at once */
+#define CACHE_FILL_BATCH	16
+/* waiting blocks are also found by sector in a hash table */
+#define CACHE_FILL_HASH_BITS	6
+#define CACHE_FILL_HASH_SIZE	(1 << CACHE_FILL_HASH_BITS)
+
+/* block waiting to be written to the cache file */
+struct cache_fill {
+	struct list_head list;
+	struct cache_fill *hash_next;	/* chain of waiting blocks */
+	sector_t sector;
+	struct cache_node *node;	/* node of block in cache file */
+	void *data;
+};
+
 /* cache characteristics */
 struct dnbd_cache {
 	int active;				/* !0 when cache active */
@@ -30,14 +50,22 @@ struct dnbd_cache {
 	size_t blksize;
 	struct cache_node *head;		/* head of LRU list */
 	struct cache_node *tail;		/* tail of LRU list */
+	struct cache_node *free;		/* blocks of failed writes */
 	spinlock_t lock;
 	struct semaphore sema;
+	struct cache_fill *fills;		/* blocks to be written */
+	struct list_head fill_free;
+	struct list_head fill_pending;
+	struct cache_fill *fill_hash[CACHE_FILL_HASH_SIZE];
+	struct workqueue_struct *fill_wq;	/* writes blocks to cache file */
+	struct work_struct fill_work;
 	int (*insert) (struct dnbd_cache * cache, sector_t sector, void *buf);
 	int (*search) (struct dnbd_cache * cache, struct request *req);	
 	void (*clean) (struct dnbd_cache * cache);
 	long hits;				/* statistics */
 	long miss;				
 	long lru;
+	long dropped;				/* blocks not written */
 	
 };
 
@@ -12,9 +12,13 @@
 
 #include "queue.h"
 #include "cache.h"
+#include "fec.h"
 #include "net.h"
+#include "readahead.h"
 
 #define MAX_DNBD 16
+#define MAX_TX_THREADS 16
+#define MAX_REQ_SECTORS 256
 #define PRINTK(level,fmt,args...) \
 	        printk(level "dnbd%d: " fmt, \
 		                (DEVICE_TO_MINOR(dnbd)) , ##args)
@@ -29,6 +33,17 @@ struct dnbd_thread {
 
 typedef struct dnbd_thread dnbd_thread_t;
 
+/* state of a request taken from the request queue, kept in req->data */
+struct dnbd_req {
+	struct list_head list;		/* free states of a device */
+	int server;			/* server the request was sent to */
+	int retries;			/* timeouts since data arrived */
+	int ahead;			/* following parts asked for already */
+	int rcvd;			/* sectors arrived ahead of a gap */
+	sector_t sector;		/* sector of first bit of map */
+	unsigned long map[BITS_TO_LONGS(MAX_REQ_SECTORS)];
+};
+
 struct dnbd_device {
 	int magic;
 	int state;
@@ -36,7 +51,7 @@ struct dnbd_device {
 	struct sockaddr_in mcast;
 	struct file *file;		
 	spinlock_t thread_lock;		/* locks */
-	spinlock_t queue_lock;
+	spinlock_t queue_lock;		/* lock of request queue */
 	spinlock_t timer_lock;	
 	struct semaphore semalock;
 	struct gendisk *disk;		/* general disk interface */
@@ -44,15 +59,24 @@ struct dnbd_device {
 	u64 bytesize;
 	atomic_t refcnt;		/* reference counter for module */
 	dnbd_thread_t rx_thread;	
-	dnbd_thread_t tx_thread;
+	dnbd_thread_t tx_thread[MAX_TX_THREADS];
 	dnbd_thread_t ss_thread;
 	atomic_t num_io_threads;
+	int inflight;			/* requests taken from request queue */
 	wait_queue_head_t io_waiters;
 	dnbd_queue_t rx_queue;		/* queue for outstanding request */
 	dnbd_queue_t tx_queue;		/* queue for requests to be sent */
+	dnbd_queue_t delay_queue;	/* requests waiting for other clients */
+	unsigned long peer_time;	/* request of other client heard at */
+	long suppressed;		/* requests asked for by other clients */
 	struct dnbd_cache cache;
+	u8 block_buf[PAGE_SIZE];	/* block of a datagram to be cached */
+	struct dnbd_fec fec;		/* recovery of lost datagrams */
+	struct dnbd_ra ra;		/* read-ahead of sequential streams */
 	struct dnbd_servers servers;	/* pointer to servers */
 	struct timer_list timer;
+	struct list_head free_reqs;	/* states of requests not taken */
+	struct dnbd_req reqs[0];	/* one for each of queue_depth */
 };
 
 typedef struct dnbd_device dnbd_device_t;
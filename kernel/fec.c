@@ -0,0 +1,243 @@
+/*
+ * fec.c - recovery of lost datagrams from parity datagrams
+ */
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/skbuff.h>
+#include <linux/udp.h>
+#include <linux/in.h>
+
+/* use optimized (MMX/SSE) routines of the RAID code if available */
+#if defined(CONFIG_MD_RAID5) || defined(CONFIG_MD_RAID5_MODULE) || \
+    defined(CONFIG_MD_RAID6) || defined(CONFIG_MD_RAID6_MODULE)
+#include <linux/raid/xor.h>
+#define FEC_XOR_BLOCK		1
+#endif
+
+#include "../common/dnbd-cliserv.h"
+#include "fec.h"
+
+/* alignment of recovered data */
+#define FEC_ALIGN		16
+/* xor_block() processes whole lines of up to 256 bytes */
+#define FEC_XOR_BYTES		512
+
+/* xor a datagram to another one */
+static void dnbd_fec_xor(void *dst, void *src, int len)
+{
+	int i;
+#ifdef FEC_XOR_BLOCK
+	void *ptr[2];
+
+	if (!(len & (FEC_XOR_BYTES - 1))) {
+		ptr[0] = dst;
+		ptr[1] = src;
+		xor_block(2, len, ptr);
+		return;
+	}
+#endif
+	for (i = 0; i + sizeof(long) <= len; i += sizeof(long))
+		*(long *) (dst + i) ^= *(long *) (src + i);
+	for (; i < len; i++)
+		((u8 *) dst)[i] ^= ((u8 *) src)[i];
+}
+
+/* free memory of window of datagrams */
+static void dnbd_fec_free(dnbd_fec_t * fec)
+{
+	int i;
+
+	if (fec->slots) {
+		for (i = 0; i < FEC_SLOTS; i++)
+			kfree(fec->slots[i].data);
+		kfree(fec->slots);
+	}
+
+	fec->slots = NULL;
+	fec->size = 0;
+}
+
+/* reserve memory for window of datagrams of size bytes */
+static int dnbd_fec_alloc(dnbd_fec_t * fec, int size)
+{
+	int i;
+	struct dnbd_fec_slot *slots;
+
+	if (!(slots = kmalloc(FEC_SLOTS * sizeof(*slots), GFP_NOIO)))
+		return -ENOMEM;
+
+	memset(slots, 0, FEC_SLOTS * sizeof(*slots));
+
+	for (i = 0; i < FEC_SLOTS; i++) {
+		if (!(slots[i].data = kmalloc(size, GFP_NOIO))) {
+			while (i--)
+				kfree(slots[i].data);
+			kfree(slots);
+			return -ENOMEM;
+		}
+	}
+
+	fec->next = 0;
+	fec->size = size;
+	fec->slots = slots;
+	return 0;
+}
+
+/* find a datagram in window */
+static struct dnbd_fec_slot *dnbd_fec_find(dnbd_fec_t * fec, u64 pos,
+					   int len)
+{
+	int i;
+
+	for (i = 0; i < FEC_SLOTS; i++) {
+		if ((fec->slots[i].pos == pos) && (fec->slots[i].len == len))
+			return &fec->slots[i];
+	}
+
+	return NULL;
+}
+
+void dnbd_fec_init(dnbd_fec_t * fec)
+{
+	memset(fec, 0, sizeof(*fec));
+}
+
+/* keep a copy of a datagram while servers send parity */
+void dnbd_fec_store(dnbd_fec_t * fec, struct sk_buff *skb, int offset,
+		    int len, u64 pos)
+{
+	struct dnbd_fec_slot *slot;
+
+	if (!fec->slots || time_after(jiffies, fec->until))
+		return;
+
+	if ((len <= 0) || (len > fec->size))
+		return;
+
+	slot = &fec->slots[fec->next];
+	if (skb_copy_bits(skb, offset, slot->data, len) < 0)
+		return;
+
+	slot->pos = pos;
+	slot->len = len;
+	fec->next = (fec->next + 1) % FEC_SLOTS;
+}
+
+/*
+ * rebuild a single lost datagram of a group from its parity,
+ * returns: new datagram to be processed like a received one or NULL
+ */
+struct sk_buff *dnbd_fec_recover(dnbd_fec_t * fec, struct sk_buff *skb,
+				 int offset)
+{
+	dnbd_reply_fec_t *parity = (dnbd_reply_fec_t *) (skb->data + offset);
+	struct dnbd_fec_slot *slot[DNBD_FEC_MAX];
+	struct sk_buff *nskb;
+	dnbd_reply_t *reply;
+	int count = ntohs(parity->count);
+	int size = ntohl(parity->size);
+	int len = ntohl(parity->len);
+	int hdrlen = sizeof(struct udphdr) + sizeof(dnbd_reply_t);
+	int i, n, missing = -1;
+	int seqlen = 0;
+	dnbd_trailer_seq_t seq;
+	void *data;
+	u16 cmd;
+
+	/* keep following datagrams */
+	fec->until = jiffies + FEC_TIMEOUT;
+
+	/* group must fit into window */
+	if ((count < 1) || (count > DNBD_FEC_MAX) || (size <= 0)
+	    || (size > FEC_DATAGRAM) || (len <= 0) || (len > count * size))
+		return NULL;
+
+	/* servers with larger datagrams need larger slots */
+	if (fec->slots && (fec->size < size))
+		dnbd_fec_free(fec);
+
+	if (!fec->slots && dnbd_fec_alloc(fec, size))
+		return NULL;
+
+	if ((int) (skb->len - offset - sizeof(dnbd_reply_fec_t)) <
+	    min(size, len))
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		if ((n = min(size, len - i * size)) <= 0)
+			return NULL;
+		if ((slot[i] = dnbd_fec_find(fec, parity->pos + i * size, n)))
+			continue;
+		/* parity can replace a single datagram only */
+		if (missing >= 0) {
+			fec->lost++;
+			return NULL;
+		}
+		missing = i;
+	}
+
+	/* nothing lost */
+	if (missing < 0)
+		return NULL;
+
+	n = min(size, len - missing * size);
+
+	/* 
+	   the lost datagram gets its sequence number back, so it is not
+	   asked for again by NACK
+	 */
+	if ((parity->cmd & DNBD_CMD_SEQ)
+	    && (skb_copy_bits(skb, offset + sizeof(dnbd_reply_fec_t) + size
+			      + missing * sizeof(seq), &seq,
+			      sizeof(seq)) >= 0))
+		seqlen = sizeof(seq);
+
+	if (!(nskb = alloc_skb(hdrlen + n + seqlen + FEC_ALIGN, GFP_NOIO)))
+		return NULL;
+
+	skb_reserve(nskb, -((unsigned long) nskb->data + hdrlen)
+		    & (FEC_ALIGN - 1));
+	skb_put(nskb, hdrlen + n + seqlen);
+	memset(nskb->data, 0, sizeof(struct udphdr));
+	data = nskb->data + hdrlen;
+
+	/* parity xor all other datagrams gives the lost one */
+	skb_copy_bits(skb, offset + sizeof(dnbd_reply_fec_t), data, n);
+	for (i = 0; i < count; i++) {
+		if (i != missing)
+			dnbd_fec_xor(data, slot[i]->data,
+				     min(slot[i]->len, n));
+	}
+
+	/* all but the last datagram of a group are followed by more */
+	cmd = DNBD_CMD_READ | DNBD_CMD_SRV;
+	if ((missing < count - 1) || (parity->cmd & DNBD_CMD_MORE))
+		cmd |= DNBD_CMD_MORE;
+	if (seqlen) {
+		memcpy(data + n, &seq, seqlen);
+		cmd |= DNBD_CMD_SEQ;
+	}
+
+	/* header in network byte order as received */
+	reply = (dnbd_reply_t *) (nskb->data + sizeof(struct udphdr));
+	reply->magic = htonl(DNBD_MAGIC);
+	reply->id = htons(parity->id);
+	reply->cmd = htons(cmd);
+	reply->pos = cpu_to_be64(parity->pos + missing * size);
+	reply->time = htons(parity->time);
+
+	nskb->ip_summed = CHECKSUM_UNNECESSARY;
+	fec->recovered++;
+
+	return nskb;
+}
+
+/* free window of datagrams */
+void dnbd_fec_clean(dnbd_fec_t * fec)
+{
+	dnbd_fec_free(fec);
+	dnbd_fec_init(fec);
+}
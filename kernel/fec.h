@@ -0,0 +1,43 @@
+#ifndef LINUX_DNBD_FEC_H
+#define LINUX_DNBD_FEC_H	1
+
+#include <linux/skbuff.h>
+#include <linux/jiffies.h>
+
+#include "../common/dnbd-cliserv.h"
+
+/* number of recent datagrams kept to recover a lost one */
+#define FEC_SLOTS		(2 * DNBD_FEC_MAX)
+/* largest datagram kept, slots grow to the datagrams of the servers */
+#define FEC_DATAGRAM		DNBD_XFER_MAX
+/* keep datagrams as long as parity arrived recently */
+#define FEC_TIMEOUT		(HZ * 8)
+
+/* a received datagram */
+struct dnbd_fec_slot {
+	u64 pos;
+	int len;			/* 0 if unused */
+	void *data;
+};
+
+/* window of received datagrams */
+struct dnbd_fec {
+	unsigned long until;		/* keep datagrams until, in jiffies */
+	int next;			/* slot to be replaced next */
+	int size;			/* bytes per slot */
+	struct dnbd_fec_slot *slots;	/* allocated with first parity */
+	long recovered;			/* statistics */
+	long lost;
+};
+
+typedef struct dnbd_fec dnbd_fec_t;
+
+/* functions */
+void dnbd_fec_init(dnbd_fec_t * fec);
+void dnbd_fec_store(dnbd_fec_t * fec, struct sk_buff *skb, int offset,
+		    int len, u64 pos);
+struct sk_buff *dnbd_fec_recover(dnbd_fec_t * fec, struct sk_buff *skb,
+				 int offset);
+void dnbd_fec_clean(dnbd_fec_t * fec);
+
+#endif				/* LINUX_DNBD_FEC_H */
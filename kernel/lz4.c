@@ -0,0 +1,131 @@
+/*
+ * lz4.c - expansion of LZ4 compressed replies
+ */
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/skbuff.h>
+#include <linux/udp.h>
+#include <linux/in.h>
+
+#include "../common/dnbd-cliserv.h"
+#include "lz4.h"
+
+/* read a length which continues in following bytes */
+static int dnbd_lz4_length(const u8 ** ip, const u8 * iend, int len)
+{
+	u8 c;
+
+	if (len != 15)
+		return len;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		c = *(*ip)++;
+		len += c;
+	} while (c == 255);
+
+	return len;
+}
+
+/*
+ * decompress a block in LZ4 block format, checking all bounds
+ * returns: size of data or -1 if block is corrupt
+ */
+int dnbd_lz4_decompress(const u8 * src, int len, u8 * dst, int max)
+{
+	const u8 *ip = src, *iend = src + len;
+	u8 *op = dst, *oend = dst + max;
+	const u8 *match;
+	int token, n, offset;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* literals */
+		if ((n = dnbd_lz4_length(&ip, iend, token >> 4)) < 0)
+			return -1;
+		if ((n > iend - ip) || (n > oend - op))
+			return -1;
+		memcpy(op, ip, n);
+		op += n;
+		ip += n;
+
+		/* last sequence has no match */
+		if (ip == iend)
+			break;
+
+		/* match, may overlap with output */
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || (offset > op - dst))
+			return -1;
+		match = op - offset;
+
+		if ((n = dnbd_lz4_length(&ip, iend, token & 15)) < 0)
+			return -1;
+		n += 4;
+		if (n > oend - op)
+			return -1;
+		while (n--)
+			*op++ = *match++;
+	}
+
+	return op - dst;
+}
+
+/*
+ * expand a compressed datagram
+ * returns: new datagram to be processed like a received one or NULL
+ */
+struct sk_buff *dnbd_lz4_expand(struct sk_buff *skb, int offset)
+{
+	dnbd_reply_lz4_t *lz4 = (dnbd_reply_lz4_t *) (skb->data + offset);
+	struct sk_buff *nskb;
+	dnbd_reply_t *reply;
+	int hdrlen = sizeof(struct udphdr) + sizeof(dnbd_reply_t);
+	int len = ntohs(lz4->len);
+	int zlen = skb->len - offset - sizeof(dnbd_reply_lz4_t);
+	u8 *zbuf;
+
+	if ((zlen <= 0) || (len <= 0) || (len > DNBD_XFER_MAX))
+		return NULL;
+
+	if (!(zbuf = kmalloc(zlen, GFP_NOIO)))
+		return NULL;
+
+	if (!(nskb = alloc_skb(hdrlen + len, GFP_NOIO)))
+		goto out;
+
+	skb_put(nskb, hdrlen + len);
+	memset(nskb->data, 0, sizeof(struct udphdr));
+
+	/* datagram may be fragmented, copy it first */
+	if ((skb_copy_bits(skb, offset + sizeof(dnbd_reply_lz4_t), zbuf,
+			   zlen) < 0)
+	    || (dnbd_lz4_decompress(zbuf, zlen, nskb->data + hdrlen, len)
+		!= len)) {
+		printk(KERN_ERR "dnbd: corrupt compressed data!\n");
+		kfree_skb(nskb);
+		nskb = NULL;
+		goto out;
+	}
+
+	/* header in network byte order as received */
+	reply = (dnbd_reply_t *) (nskb->data + sizeof(struct udphdr));
+	reply->magic = htonl(DNBD_MAGIC);
+	reply->id = htons(lz4->id);
+	reply->cmd = htons((lz4->cmd & ~DNBD_CMD_MASK) | DNBD_CMD_READ);
+	reply->pos = cpu_to_be64(lz4->pos);
+	reply->time = htons(lz4->time);
+
+	nskb->ip_summed = CHECKSUM_UNNECESSARY;
+      out:
+	kfree(zbuf);
+	return nskb;
+}
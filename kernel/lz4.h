@@ -0,0 +1,10 @@
+#ifndef LINUX_DNBD_LZ4_H
+#define LINUX_DNBD_LZ4_H	1
+
+#include <linux/skbuff.h>
+
+/* functions */
+int dnbd_lz4_decompress(const u8 * src, int len, u8 * dst, int max);
+struct sk_buff *dnbd_lz4_expand(struct sk_buff *skb, int offset);
+
+#endif				/* LINUX_DNBD_LZ4_H */
@@ -44,13 +44,38 @@
 #include "dnbd.h"
 #include "queue.h"
 #include "cache.h"
+#include "fec.h"
+#include "lz4.h"
 #include "net.h"
+#include "readahead.h"
 
 #define LO_MAGIC 0x68797548
 #define DEVICE_TO_MINOR(dnbd) ((int)((dnbd)-dnbd_dev[0]))
 
+/* state of a request, see dnbd_do_request() */
+#define REQ_STATE(req)		((struct dnbd_req *) (req)->data)
+
+/* parts of a request asked for at once, each as large as the server allows */
+#define REQ_PARTS_MAX		64
+
+/* 
+ * seconds between heartbeats to servers sending beacons, which forget
+ * the capabilities of clients they did not hear from for a while
+ */
+#define HB_ANNOUNCE		30
+
 int dnbd_major = DNBD_MAJOR;
 
+/* requests taken from the request queue of a device at once */
+static int queue_depth = 128;
+module_param(queue_depth, int, 0444);
+MODULE_PARM_DESC(queue_depth, "requests handled per device at once");
+
+/* threads sending requests of a device, a slow cache stalls only one */
+static int tx_threads = 4;
+module_param(tx_threads, int, 0444);
+MODULE_PARM_DESC(tx_threads, "threads sending requests per device");
+
 /* private structures */
 typedef int (*thread_fn_t) (void *);
 
@@ -72,12 +97,17 @@ static int dnbd_end_request(dnbd_device_t * dnbd, struct request *req,
 
 	spin_lock_irqsave(q->queue_lock, flags);
 	if (!(result = end_that_request_first(req, success, size))) {
+		list_add(&REQ_STATE(req)->list, &dnbd->free_reqs);
+		req->data = NULL;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
 		end_that_request_last(req,success);
 #else
 		end_that_request_last(req);
 #endif
-
+		/* room for the next request of the elevator */
+		dnbd->inflight--;
+		if (blk_queue_stopped(q))
+			blk_start_queue(q);
 	}
 	spin_unlock_irqrestore(q->queue_lock, flags);
 	return result;		/* 0, if request is completed */
@@ -98,6 +128,8 @@ void dnbd_clear_queue(dnbd_device_t * dnbd, dnbd_queue_t * q)
 /* empty all queues: tx_queue, rx_queue */
 void dnbd_clear_queues(dnbd_device_t * dnbd)
 {
+	int i, active = 0;
+
 	spin_lock_irq(&dnbd->thread_lock);
 
 	if (dnbd->rx_thread.task) {
@@ -107,11 +139,16 @@ void dnbd_clear_queues(dnbd_device_t * dnbd)
 		dnbd_clear_queue(dnbd, &dnbd->rx_queue);
 	}
 
-	if (dnbd->tx_thread.task) {
+	for (i = 0; i < tx_threads; i++)
+		if (dnbd->tx_thread[i].task)
+			active = 1;
+
+	if (active) {
 		printk(KERN_ERR
 		       "dnbd_clear_queues: tx_thread still active!\n");
 	} else {
 		dnbd_clear_queue(dnbd, &dnbd->tx_queue);
+		dnbd_clear_queue(dnbd, &dnbd->delay_queue);
 	}
 
 	spin_unlock_irq(&dnbd->thread_lock);
@@ -182,57 +219,261 @@ static int sock_xmit(dnbd_device_t * dnbd, int send, void *buf, int size,
 static void dnbd_xfer_to_cache(dnbd_device_t * dnbd, struct sk_buff *skb,
 			       int offset, int remain, sector_t sector)
 {
-	mm_segment_t oldfs = get_fs();
-	int result;
 	size_t blksize = dnbd->cache.blksize;
-	char block_buf[blksize];
-	struct iovec iov;
+	void *data;
 
 	if (!dnbd->cache.active)
 		return;
 
-	set_fs(get_ds());
 	while (remain >= blksize) {
-		iov.iov_base = &block_buf;
-		iov.iov_len = blksize;
-		/* copy data from socket buffer */
-		if ((result =
-		     skb_copy_datagram_iovec(skb, offset, &iov,
-					     blksize)) < 0) {
+		/* 
+		   data in the linear part of the socket buffer is written
+		   as it is, other data is gathered into the block buffer
+		 */
+		if (!(data = skb_header_pointer(skb, offset, blksize,
+						dnbd->block_buf))) {
 			printk(KERN_WARNING
-			       "dnbd: error copy packet to iovec!\n");
+			       "dnbd: error copy packet to cache!\n");
+			return;
+		}
+		/* 
+		   and insert to cache, a dropped block is no longer read
+		   ahead and the cache file does not keep up with read-ahead
+		 */
+		if (dnbd->cache.insert(&dnbd->cache, sector, data) < 0) {
+			dnbd_ra_done(&dnbd->ra, sector, blksize >> 9);
+			dnbd_ra_timeout(&dnbd->ra);
 		}
-		/* and insert to cache */
-		dnbd->cache.insert(&dnbd->cache, sector, &block_buf);
 		remain -= blksize;
 		offset += blksize;
 		sector += blksize / (1 << 9);
 	}
-	set_fs(oldfs);
 }
 
-/* process incoming network packets */
-static int inline dnbd_recv_reply(dnbd_device_t * dnbd)
+/* 
+ * copy data of a datagram to the BIOs of a request, starting skip bytes
+ * into the request, whole blocks are also written to the cache from the
+ * pages they were copied to
+ */
+static int dnbd_xfer_to_request(dnbd_device_t * dnbd, struct request *req,
+				struct sk_buff *skb, int offset, int remain,
+				int skip)
 {
-	mm_segment_t oldfs = get_fs();
-	int i;
-	unsigned int nsect = 0;
-	int err;
-	struct sk_buff *skb;
-	struct iovec iov;
-	int remain, offset, tocopy;
-	dnbd_reply_t *reply;
-	struct request *req = NULL;
+	int i, err;
+	int tocopy, copied = 0, done = 0, part;
+	size_t blksize = dnbd->cache.blksize;
 	struct bio *bio;
 	struct bio_vec *bvec;
-	int tt;
 	void *kaddr;
 
-	/* sleep until packet arrives */
-	skb = skb_recv_datagram(dnbd->sock->sk, 0, 0, &err);
+	/* a datagram may start and end within a segment */
+	rq_for_each_bio(bio, req) {
+		bio_for_each_segment(bvec, bio, i) {
+			if (remain <= 0)
+				goto out;
+			if (done + bvec->bv_len <= skip) {
+				done += bvec->bv_len;
+				continue;
+			}
+			part = max(skip - done, 0);
+			tocopy = min_t(int, bvec->bv_len - part, remain);
+			kaddr = kmap(bvec->bv_page) + bvec->bv_offset + part;
+			err = skb_copy_bits(skb, offset, kaddr, tocopy);
+
+			if (!err && dnbd->cache.active && !part
+			    && (tocopy == blksize)
+			    && !((req->sector + (done >> 9))
+				 & ((blksize >> 9) - 1)))
+				dnbd->cache.insert(&dnbd->cache,
+						   req->sector + (done >> 9),
+						   kaddr);
+			kunmap(bvec->bv_page);
 
-	if (!skb)
-		goto out_nofree;
+			if (err) {
+				printk(KERN_ERR "dnbd: ERROR copy data\n");
+				goto out;
+			}
+
+			offset += tocopy;
+			remain -= tocopy;
+			copied += tocopy;
+			done += bvec->bv_len;
+		}
+	}
+      out:
+	return copied;
+}
+
+/* 
+ * note count sectors of a request received ahead of a gap,
+ * returns: number of sectors which did not arrive before
+ */
+static int dnbd_rcvd_set(struct request *req, sector_t sector, int count)
+{
+	struct dnbd_req *state = REQ_STATE(req);
+	int fresh = 0;
+
+	/* the map covers all sectors the request had when it was taken */
+	for (; count > 0; count--, sector++) {
+		if ((sector >= state->sector)
+		    && (sector - state->sector < MAX_REQ_SECTORS)
+		    && !__test_and_set_bit(sector - state->sector, state->map))
+			fresh++;
+	}
+
+	state->rcvd += fresh;
+	return fresh;
+}
+
+/* count sectors received ahead which follow the first n of a request */
+static int dnbd_rcvd_next(struct request *req, int n)
+{
+	struct dnbd_req *state = REQ_STATE(req);
+	sector_t sector = req->sector + n;
+	int count = 0;
+
+	if (!state->rcvd)
+		return 0;
+
+	while ((n + count < req->nr_sectors)
+	       && (sector + count - state->sector < MAX_REQ_SECTORS)
+	       && test_bit(sector + count - state->sector, state->map))
+		count++;
+
+	return count;
+}
+
+/* remove a trailer from the end of a reply */
+static int dnbd_trailer(struct sk_buff *skb, int offset, void *buf, int len)
+{
+	if ((int) skb->len < offset + (int) sizeof(dnbd_reply_t) + len)
+		return -EINVAL;
+
+	if (skb_copy_bits(skb, skb->len - len, buf, len) < 0)
+		return -EFAULT;
+
+	return pskb_trim(skb, skb->len - len);
+}
+
+/* let the timer for retransmits expire at a deadline, or earlier */
+static void dnbd_arm_timer(dnbd_device_t * dnbd, unsigned long expires)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dnbd->timer_lock, flags);
+	if ((dnbd->state & DNBD_STATE_RUNNING)
+	    && (!timer_pending(&dnbd->timer)
+		|| time_before(expires, dnbd->timer.expires)))
+		mod_timer(&dnbd->timer, expires);
+	spin_unlock_irqrestore(&dnbd->timer_lock, flags);
+}
+
+/* 
+ * wait for a reply of server id until the request times out, rx_queue
+ * is sorted by these deadlines in start_time
+ */
+static void dnbd_wait_reply(dnbd_device_t * dnbd, struct request *req,
+			    int id)
+{
+	REQ_STATE(req)->server = id;
+	req->start_time = jiffies
+	    + dnbd_rto_server(&dnbd->servers, id, REQ_STATE(req)->retries);
+	dnbd_enq_request_sorted(&dnbd->rx_queue, req, 0);
+	dnbd_arm_timer(dnbd, req->start_time);
+}
+
+/* 
+ * find outstanding request of len bytes of a datagram at pos, also one
+ * they only overlap, or an unsent one starting at pos
+ */
+static struct request *dnbd_find_request(dnbd_device_t * dnbd, u64 pos,
+					 int len)
+{
+	struct request *req;
+
+	if ((req = dnbd_deq_request_handle(&dnbd->rx_queue, pos)))
+		return req;
+
+	/* datagrams may arrive before those in front of them */
+	if (!(pos & 511) && (len >= 512)
+	    && (req = dnbd_deq_request_overlap(&dnbd->rx_queue, pos >> 9,
+					       (pos + len) >> 9,
+					       (dnbd->blksize >> 9) - 1)))
+		return req;
+
+	/* a reply to another client makes asking for it needless */
+	if ((req = dnbd_deq_request_handle(&dnbd->delay_queue, pos))
+	    || (req = dnbd_deq_request_handle(&dnbd->tx_queue, pos)))
+		dnbd->suppressed++;
+
+	return req;
+}
+
+/* 
+ * another client asked for data, delayed requests of the same blocks
+ * wait for its reply instead of being sent
+ */
+static void dnbd_suppress_requests(dnbd_device_t * dnbd,
+				   struct sk_buff *skb, int offset)
+{
+	dnbd_request_map_t request;
+	struct request *req;
+	int len = sizeof(dnbd_request_t);
+	u64 map = 1, size;
+	int i;
+
+	dnbd->peer_time = jiffies;
+
+	if (skb->len - offset >= sizeof(dnbd_request_map_t))
+		len = sizeof(dnbd_request_map_t);
+	if (skb_copy_bits(skb, offset, &request, len) < 0)
+		return;
+
+	/* requests wait for a reply of a valid server only */
+	if ((request.id < 1) || (request.id > SERVERS_MAX))
+		return;
+
+	/* header is already in host byte order */
+	size = ntohs(request.len);
+	if (request.cmd & DNBD_CMD_SECTORS)
+		size <<= 9;
+	if (request.cmd & DNBD_CMD_MAP) {
+		if (len < sizeof(dnbd_request_map_t))
+			return;
+		map = be64_to_cpu(request.map);
+	}
+
+	for (i = 0; map; i++, map >>= 1) {
+		if (!(map & 1))
+			continue;
+		if (!(req = dnbd_deq_request_handle(&dnbd->delay_queue,
+						    request.pos + i * size)))
+			continue;
+		/* ask ourselves if the reply gets lost */
+		dnbd_wait_reply(dnbd, req, request.id);
+		dnbd->suppressed++;
+	}
+}
+
+/* 
+ * process a received or recovered datagram, tt is the round trip time
+ * in microseconds of the datagram it was rebuilt from or -1
+ */
+static int dnbd_process_reply(dnbd_device_t * dnbd, struct sk_buff *skb,
+			      int tt)
+{
+	unsigned int nsect = 0;
+	int remain, offset, copied, skip, pending, fresh;
+	u64 start;
+	dnbd_reply_t *reply;
+	dnbd_reply_busy_t *busy;
+	dnbd_reply_init_ext_t *init;
+	struct request *req = NULL;
+	struct sk_buff *rskb;
+	dnbd_trailer_seq_t seq;
+	dnbd_trailer_usec_t usec;
+	dnbd_trailer_load_t load;
+	u64 map;
 
 	/* 
 	   some NICs can verify checksums themselves and then is 
@@ -258,17 +499,89 @@ static int inline dnbd_recv_reply(dnbd_device_t * dnbd)
 		goto out;
 	}
 
-	/* calculate RTT */
-	tt = jiffies & 0xffff;
-	tt -= reply->time;
-	if (tt < 0)
-		tt += 1 << 16;
+	/* trailers follow in order of their flags, take the last one first */
+	if ((reply->cmd & DNBD_CMD_SRV) && (reply->cmd & DNBD_CMD_LOAD)) {
+		if (dnbd_trailer(skb, offset, &load, sizeof(load)))
+			goto out;
+		reply->cmd &= ~DNBD_CMD_LOAD;
+		dnbd_load_server(&dnbd->servers, reply->id, ntohs(load.depth),
+				 ntohs(load.service), load.hits);
+	}
+
+	if ((reply->cmd & DNBD_CMD_SRV) && (reply->cmd & DNBD_CMD_USEC)) {
+		if (dnbd_trailer(skb, offset, &usec, sizeof(usec)))
+			goto out;
+		reply->cmd &= ~DNBD_CMD_USEC;
+		tt = dnbd_usecs() - ntohl(usec);
+	}
+
+	/* 
+	   gaps in sequence numbers of a server reveal lost datagrams,
+	   parity carries those of its group for the one it recovers
+	 */
+	if ((reply->cmd & DNBD_CMD_SRV) && (reply->cmd & DNBD_CMD_SEQ)
+	    && ((reply->cmd & DNBD_CMD_MASK) != DNBD_CMD_FEC)) {
+		if (dnbd_trailer(skb, offset, &seq, sizeof(seq)))
+			goto out;
+		reply->cmd &= ~DNBD_CMD_SEQ;
+		dnbd_seq_server(&dnbd->servers, reply->id, ntohl(seq),
+				!list_empty(&dnbd->rx_queue.head));
+	}
+
+	/* 
+	   calculate RTT from jiffies for servers without timestamps in
+	   microseconds, their samples would be too coarse for the others,
+	   data pushed by a server without request has no RTT at all
+	 */
+	if ((tt < 0) && !(reply->cmd & DNBD_CMD_PUSH)
+	    && !(dnbd_server_caps(&dnbd->servers, reply->id)
+		 & DNBD_CAP_USEC)) {
+		tt = jiffies & 0xffff;
+		tt -= reply->time;
+		if (tt < 0)
+			tt += 1 << 16;
+		tt = jiffies_to_usecs(tt);
+	}
 
 	/* check reply command */
 	if (reply->cmd & DNBD_CMD_SRV) {
 		switch (reply->cmd & DNBD_CMD_MASK) {
 		case DNBD_CMD_READ:
 			break;
+		case DNBD_CMD_BUSY:
+			dnbd_rx_update(dnbd->servers, reply->id);
+			if (skb->len - offset < sizeof(dnbd_reply_busy_t))
+				goto out;
+			busy = (dnbd_reply_busy_t *) reply;
+			dnbd_busy_server(&dnbd->servers, reply->id,
+					 ntohs(busy->depth));
+			/* redirect request at once if another server is idle */
+			if (dnbd_idle_servers(&dnbd->servers)
+			    && (req = dnbd_deq_request_handle(&dnbd->rx_queue,
+							      reply->pos)))
+				dnbd_enq_request(&dnbd->tx_queue, req, 1);
+			goto out;
+		case DNBD_CMD_FEC:
+			dnbd_rx_update(dnbd->servers, reply->id);
+			if (skb->len - offset < sizeof(dnbd_reply_fec_t))
+				goto out;
+			/* rebuild a lost datagram from parity */
+			if ((rskb = dnbd_fec_recover(&dnbd->fec, skb, offset))) {
+				nsect = dnbd_process_reply(dnbd, rskb, -1);
+				kfree_skb(rskb);
+			}
+			goto out;
+		case DNBD_CMD_LZ4:
+			if (skb->len - offset < sizeof(dnbd_reply_lz4_t))
+				goto out;
+			/* expand and process like a plain reply */
+			if ((rskb = dnbd_lz4_expand(skb, offset))) {
+				nsect = dnbd_process_reply(dnbd, rskb, tt);
+				kfree_skb(rskb);
+			}
+			goto out;
+		/* same as heartbeat reply, but without RTT */
+		case DNBD_CMD_BEACON:
 		case DNBD_CMD_HB:
 			if (!dnbd_set_serverid(&dnbd->servers, reply->id))
 				printk(KERN_INFO
@@ -276,69 +589,148 @@ static int inline dnbd_recv_reply(dnbd_device_t * dnbd)
 				       reply->id);
 			/* update times */
 			dnbd_rx_update(dnbd->servers, reply->id);
-			dnbd_rtt_server(&dnbd->servers, reply->id, tt);
+			if (tt >= 0)
+				dnbd_rtt_server(&dnbd->servers, reply->id, tt);
+			/* servers of version 0 send no capabilities */
+			if (skb->len - offset >= sizeof(dnbd_reply_init_ext_t)) {
+				init = (dnbd_reply_init_ext_t *) reply;
+				dnbd_set_caps(&dnbd->servers, reply->id,
+					      ntohs(init->version),
+					      ntohl(init->caps),
+					      ntohl(init->xfersize));
+			}
 		default:
 			goto out;
 		}
+	} else if ((reply->cmd & DNBD_CMD_MASK) == DNBD_CMD_NACK) {
+		/* another client reported lost datagrams, no need to repeat */
+		if ((reply->cmd & DNBD_CMD_MAP) && (skb->len - offset
+						    >= sizeof(dnbd_request_map_t))
+		    && (skb_copy_bits(skb, offset + offsetof(dnbd_request_map_t,
+							    map),
+				      &map, sizeof(map)) >= 0))
+			dnbd_suppress_nack(&dnbd->servers, reply->id,
+					   (u32) reply->pos, be64_to_cpu(map));
+		goto out;
+	} else if ((reply->cmd & DNBD_CMD_MASK) == DNBD_CMD_READ) {
+		dnbd_suppress_requests(dnbd, skb, offset);
+		goto out;
 	} else
 		goto out;
 
 	/* update times */
 	dnbd_rx_update(dnbd->servers, reply->id);
 
-	/* try to find outstanding request */
-	req = dnbd_deq_request_handle(&dnbd->rx_queue, reply->pos);
+	/* requests keep the id of a valid server only */
+	if (reply->id > SERVERS_MAX)
+		reply->id = 0;
 
 	offset += sizeof(struct dnbd_reply);
 	remain = skb->len - offset;
 
-	/* we know this request? No? Let's cache it ... */
-	if (!req) {
-		if ((reply->cmd & DNBD_CMD_SRV)
-		    && (reply->cmd & DNBD_CMD_READ))
+	/* keep data in case a datagram of its group gets lost */
+	dnbd_fec_store(&dnbd->fec, skb, offset, remain, reply->pos);
+
+	/* requests need not wait for data read ahead any longer */
+	dnbd_ra_done(&dnbd->ra, reply->pos >> 9, remain >> 9);
+
+	/* a datagram of a multi-block reply may span several requests */
+	while (remain > 0) {
+		/* we know this request? No? Let's cache it ... */
+		if (!(req = dnbd_find_request(dnbd, reply->pos, remain))) {
 			dnbd_xfer_to_cache(dnbd, skb, offset, remain,
 					   reply->pos >> 9);
-		if (!req)
-			goto out;
-	}
+			break;
+		}
 
-	/* the reply fits to an outstanding request */
-	dnbd_rtt_server(&dnbd->servers, reply->id, tt);
+		/* the reply fits to an outstanding request */
+		if (tt >= 0) {
+			dnbd_rtt_server(&dnbd->servers, reply->id, tt);
+			tt = -1;
+		}
 
-	nsect = 0;
-	err = 0;
-	/* copy network data to BIOs */
-	rq_for_each_bio(bio, req) {
-		bio_for_each_segment(bvec, bio, i) {
-			tocopy = bvec->bv_len;
-			if (tocopy > remain)
-				goto nobytesleft;
-			kaddr = kmap(bvec->bv_page);
-			iov.iov_base = kaddr + bvec->bv_offset;
-			iov.iov_len = tocopy;
-			set_fs(KERNEL_DS);
-			err =
-			    skb_copy_datagram_iovec(skb, offset, &iov,
-						    tocopy);
-			set_fs(oldfs);
-			kunmap(bvec->bv_page);
+		/* data in front of the request is cached */
+		start = (u64) req->sector << 9;
+		if (reply->pos < start) {
+			copied = min_t(u64, start - reply->pos, remain);
+			dnbd_xfer_to_cache(dnbd, skb, offset, copied,
+					   reply->pos >> 9);
+			offset += copied;
+			remain -= copied;
+			reply->pos += copied;
+		}
 
-			if (err) {
-				printk(KERN_ERR "dnbd: ERROR copy data\n");
-				goto nobytesleft;
-			}
+		skip = reply->pos - start;
+		copied = dnbd_xfer_to_request(dnbd, req, skb, offset, remain,
+					      skip);
+		offset += copied;
+		remain -= copied;
+		nsect += copied >> 9;
 
-			offset += tocopy;
-			remain -= tocopy;
-			nsect += bvec->bv_len >> 9;
+		/* 
+		   data following a gap is kept until the gap is filled,
+		   otherwise the request ends up to the next gap
+		 */
+		fresh = copied >> 9;
+		if (skip) {
+			fresh = dnbd_rcvd_set(req, reply->pos >> 9, fresh);
+			pending = 1;
+		} else
+			pending = dnbd_end_request(dnbd, req, 1, (copied >> 9)
+						   + dnbd_rcvd_next(req,
+								    copied
+								    >> 9));
+		reply->pos += copied;
+
+		/* 
+		   a part ends once, a datagram repaired twice (NACK and
+		   parity) leaves the parts ahead and the deadline as they are
+		 */
+		if (pending && !fresh) {
+			dnbd_enq_request_sorted(&dnbd->rx_queue, req, 0);
+			dnbd_arm_timer(dnbd, req->start_time);
+		} else if (pending) {
+			/* data arrived, so retries start over */
+			REQ_STATE(req)->server = reply->id;
+			REQ_STATE(req)->retries = 0;
+			/* 
+			   wait for next datagram or part, or for the repair
+			   of a gap (NACK, parity), or ask for the rest
+			 */
+			if (reply->cmd & DNBD_CMD_MORE)
+				dnbd_wait_reply(dnbd, req, reply->id);
+			else if (REQ_STATE(req)->ahead) {
+				REQ_STATE(req)->ahead--;
+				dnbd_wait_reply(dnbd, req, reply->id);
+			} else if (REQ_STATE(req)->rcvd)
+				dnbd_wait_reply(dnbd, req, reply->id);
+			else
+				dnbd_enq_request(&dnbd->tx_queue, req, 1);
 		}
-	}
-      nobytesleft:
-	/* end request partially or fully */
-	if (dnbd_end_request(dnbd, req, 1, nsect)) {
-		dnbd_enq_request(&dnbd->tx_queue, req, 1);
+
+		if (!copied)
+			break;
 	}
       out:
+	return nsect;
+}
+
+/* process incoming network packets */
+static int inline dnbd_recv_reply(dnbd_device_t * dnbd)
+{
+	unsigned int nsect = 0;
+	int err;
+	struct sk_buff *skb;
+
+	/* sleep until packet arrives or a NACK is due */
+	dnbd->sock->sk->sk_rcvtimeo = dnbd_nack_timeout(&dnbd->servers);
+	skb = skb_recv_datagram(dnbd->sock->sk, 0, 0, &err);
+
+	if (!skb)
+		goto out_nofree;
+
+	nsect = dnbd_process_reply(dnbd, skb, -1);
+
 	/* free reserved memory of packet */
 	skb_free_datagram(dnbd->sock->sk, skb);
       out_nofree:
@@ -346,35 +738,189 @@ static int inline dnbd_recv_reply(dnbd_device_t * dnbd)
 	return nsect;
 }
 
-static int dnbd_send_request(dnbd_device_t * dnbd, struct request *req)
+/* serve a request from cache, returns 1 if it is not sent now */
+static int dnbd_cache_request(dnbd_device_t * dnbd, struct request *req)
 {
-	int result = 0;
-	dnbd_request_t request;
-	unsigned long size = req->current_nr_sectors << 9;
-	int id;
+	int cached;
+
+	if (!(cached = dnbd->cache.search(&dnbd->cache, req)))
+		return 0;
+
+	if (dnbd_end_request(dnbd, req, 1, cached))
+		dnbd_enq_request(&dnbd->tx_queue, req, 1);
+	return 1;
+}
+
+/* collect requests following a request to server id into a map */
+static u64 dnbd_map_requests(dnbd_device_t * dnbd, struct request *req,
+			     int id)
+{
+	int shift = blksize_bits(dnbd->blksize) - 9;
+	sector_t mask = (1 << shift) - 1;
+	sector_t start = req->sector;
+	sector_t end = start + (DNBD_MAP_BLOCKS << shift);
+	sector_t sector;
+	struct request *next = req;
+	u64 map = 0;
+
+	/* only whole blocks can be mapped */
+	if ((req->sector & mask) || (req->nr_sectors & mask))
+		return 0;
+
+	do {
+		/* the first request is sent by the caller */
+		if (next != req) {
+			if (dnbd_cache_request(dnbd, next))
+				continue;
+			dnbd_wait_reply(dnbd, next, id);
+		}
+
+		for (sector = next->sector;
+		     (sector < next->sector + next->nr_sectors)
+		     && (sector < end); sector += mask + 1)
+			map |= (u64) 1 << ((sector - start) >> shift);
 
-	/* find nearest server */
-	id = dnbd_next_server(&dnbd->servers);
+	} while ((next =
+		  dnbd_deq_request_range(&dnbd->tx_queue, start, end, mask))
+		 || (next =
+		     dnbd_deq_request_range(&dnbd->delay_queue, start, end,
+					    mask)));
+
+	return map;
+}
+
+/* 
+ * give other clients the chance to ask for a request first,
+ * returns 1 if it is not sent now
+ */
+static int dnbd_delay_request(dnbd_device_t * dnbd, struct request *req)
+{
+	/* nobody else around to wait for */
+	if (!time_before(jiffies, dnbd->peer_time + PEER_TIMEOUT))
+		return 0;
+
+	req->start_time = jiffies + dnbd_request_delay(&dnbd->servers);
+	dnbd_enq_request_sorted(&dnbd->delay_queue, req, 0);
+	return 1;
+}
+
+/* send a read request of size bytes at pos to server id */
+static int dnbd_send_read(dnbd_device_t * dnbd, int id, u16 cmd, u64 pos,
+			  unsigned long size, u64 map)
+{
+	dnbd_request_map_t request;
+	dnbd_trailer_usec_t usec;
+	u8 buf[sizeof(request) + sizeof(usec)];
+	int len = sizeof(dnbd_request_t);
+
+	if (cmd & DNBD_CMD_MAP) {
+		len = sizeof(dnbd_request_map_t);
+		request.map = cpu_to_be64(map);
+	}
+
+	/* length field has only 16 bits */
+	if (size > 0xffff) {
+		cmd |= DNBD_CMD_SECTORS;
+		request.len = cpu_to_be16(size >> 9);
+	} else
+		request.len = cpu_to_be16(size);
+
+	/* servers which echo a timestamp get one after the request */
+	if (dnbd_server_caps(&dnbd->servers, id) & DNBD_CAP_USEC)
+		cmd |= DNBD_CMD_USEC;
 
 	/* fill structure for a DNBD request */
 	request.magic = cpu_to_be32(DNBD_MAGIC);
 	request.id = cpu_to_be16((u16) id);
 	request.time = cpu_to_be16(jiffies & 0xffff);
-	request.cmd = cpu_to_be16(DNBD_CMD_READ | DNBD_CMD_CLI);
-	request.pos = cpu_to_be64((u64) req->sector << 9);
-	request.len = cpu_to_be16(size);
+	request.cmd = cpu_to_be16(cmd);
+	request.pos = cpu_to_be64(pos);
+
+	memcpy(buf, &request, len);
+	if (cmd & DNBD_CMD_USEC) {
+		usec = cpu_to_be32(dnbd_usecs());
+		memcpy(buf + len, &usec, sizeof(usec));
+		len += sizeof(usec);
+	}
 
 	/* send DNBD request */
-	INFO("Sending request of %d sectors, starting from sector no: %llu\n", 
-			request.len, request.pos);
-	result = sock_xmit(dnbd, 1, &request, sizeof(request), 0);
+	INFO("Sending request of %lu bytes, starting from sector no: %llu\n",
+	     size, pos >> 9);
+	return sock_xmit(dnbd, 1, buf, len, 0);
+}
+
+static int dnbd_send_request(dnbd_device_t * dnbd, struct request *req)
+{
+	int result = 0;
+	unsigned long total = req->nr_sectors << 9;
+	unsigned long size = total;
+	u16 cmd = DNBD_CMD_READ | DNBD_CMD_CLI;
+	int id, parts = 1, i;
+	u64 map = 0;
+
+	/* find nearest server, another one if the request timed out */
+	id = dnbd_next_server(&dnbd->servers,
+			      REQ_STATE(req)->retries ?
+			      REQ_STATE(req)->server : 0);
+
+	/* ask for pending requests nearby in the same packet */
+	if ((dnbd_server_caps(&dnbd->servers, id) & DNBD_CAP_MAP)
+	    && (map = dnbd_map_requests(dnbd, req, id))) {
+		cmd |= DNBD_CMD_MAP;
+		size = dnbd->blksize;
+	}
+	/* 
+	   ask for as much of the request as the server can send at once,
+	   and for the following parts of the request as well, so they
+	   arrive within a single round trip
+	 */
+	else if (size > dnbd_xfersize(&dnbd->servers, id)) {
+		size = dnbd_xfersize(&dnbd->servers, id);
+		parts = min((total + size - 1) / size,
+			    (unsigned long) REQ_PARTS_MAX);
+	}
+
+	/* replies end after each part, the first one is waited for */
+	REQ_STATE(req)->ahead = parts - 1;
+	dnbd_wait_reply(dnbd, req, id);
+
+	for (i = 0; (i < parts) && (result >= 0); i++)
+		result = dnbd_send_read(dnbd, id, cmd,
+					((u64) req->sector << 9) + i * size,
+					min(size, total - i * size), map);
+
 	/* set times */
-	req->start_time = jiffies;
 	dnbd_tx_update(dnbd->servers, id);
 
 	return result;
 }
 
+/* 
+ * ask for data of sequential streams ahead of their reads, the replies
+ * are kept in the cache
+ */
+static void dnbd_send_readahead(dnbd_device_t * dnbd)
+{
+	sector_t sector;
+	unsigned int count;
+	int id, sent = 0;
+
+	if (!dnbd->cache.active || !dnbd_ra_wanted(&dnbd->ra))
+		return;
+
+	id = dnbd_next_server(&dnbd->servers, 0);
+
+	while (dnbd_ra_next(&dnbd->ra, &sector, &count,
+			    dnbd_xfersize(&dnbd->servers, id) >> 9)) {
+		dnbd_send_read(dnbd, id, DNBD_CMD_READ | DNBD_CMD_CLI,
+			       (u64) sector << 9, count << 9, 0);
+		sent++;
+	}
+
+	if (sent)
+		dnbd_tx_update(dnbd->servers, id);
+}
+
 /* same for heartbeats */
 static int dnbd_send_hb(dnbd_device_t * dnbd)
 {
@@ -384,8 +930,9 @@ static int dnbd_send_hb(dnbd_device_t * dnbd)
 	request.magic = cpu_to_be32(DNBD_MAGIC);
 	request.id = cpu_to_be16((u16) 0);
 	request.time = cpu_to_be16(jiffies & 0xffff);
-	request.cmd = cpu_to_be16(DNBD_CMD_HB | DNBD_CMD_CLI);
-	request.pos = 0;
+	request.cmd = cpu_to_be16(DNBD_CMD_HB | DNBD_CMD_CLI | DNBD_CMD_EXT);
+	request.pos =
+	    cpu_to_be64(DNBD_EXT_POS(DNBD_PROTO_VERSION, DNBD_CAPS));
 	request.len = 0;
 
 	INFO("Sending heartbeat command \n");
@@ -394,6 +941,34 @@ static int dnbd_send_hb(dnbd_device_t * dnbd)
 	return result;
 }
 
+/* report lost datagrams to a server */
+static int dnbd_send_nack(dnbd_device_t * dnbd, int id, u32 seq, u64 map)
+{
+	dnbd_request_map_t request;
+
+	request.magic = cpu_to_be32(DNBD_MAGIC);
+	request.id = cpu_to_be16((u16) id);
+	request.time = cpu_to_be16(jiffies & 0xffff);
+	request.cmd =
+	    cpu_to_be16(DNBD_CMD_NACK | DNBD_CMD_CLI | DNBD_CMD_MAP);
+	request.pos = cpu_to_be64((u64) seq);
+	request.len = 0;
+	request.map = cpu_to_be64(map);
+
+	return sock_xmit(dnbd, 1, &request, sizeof(request), 0);
+}
+
+/* send all NACKs which are due */
+static void dnbd_send_nacks(dnbd_device_t * dnbd)
+{
+	int id;
+	u32 seq;
+	u64 map;
+
+	while (dnbd_next_nack(&dnbd->servers, &id, &seq, &map))
+		dnbd_send_nack(dnbd, id, seq, map);
+}
+
 /* helper function to start threads */
 static int dnbd_start_thread(dnbd_device_t * dnbd,
 			     dnbd_thread_t * thread, thread_fn_t fn)
@@ -474,6 +1049,7 @@ static int dnbd_rx_loop(void *data)
 	/* loop until SIGKILL arrives */
 	while ((signr = signal_pending(current)) == 0) {
 		dnbd_recv_reply(dnbd);
+		dnbd_send_nacks(dnbd);
 	}
 
 	spin_lock(&dnbd->thread_lock);
@@ -495,8 +1071,10 @@ static int dnbd_tx_loop(void *data)
 {
 	int signr;
 	dnbd_device_t *dnbd = (dnbd_device_t *) data;
+	dnbd_thread_t *thread;
 	struct request *req;
-	int result, cached;
+	int result, delayed;
+	long timeout;
 
 	__module_get(THIS_MODULE);
 	printk("tx_loop: enter\n");
@@ -504,45 +1082,55 @@ static int dnbd_tx_loop(void *data)
 	daemonize("dnbd_tx_loop");
 	allow_signal(SIGKILL);
 
+	/* 
+	   threads are started one after the other, so the only slot
+	   reserved by dnbd_start_thread() is ours
+	 */
 	spin_lock(&dnbd->thread_lock);
-	dnbd->tx_thread.task = current;
+	for (thread = dnbd->tx_thread;
+	     thread->task != (struct task_struct *) -1; thread++);
+	thread->task = current;
 	spin_unlock(&dnbd->thread_lock);
 
-	complete(&dnbd->tx_thread.startup);
+	complete(&thread->startup);
 
 	/* loop until SIGKILL arrives */
 	while ((signr = signal_pending(current)) == 0) {
-		req = dnbd_try_deq_request(&dnbd->tx_queue);
+		/* read ahead only while no request is waiting */
+		if (list_empty(&dnbd->tx_queue.head))
+			dnbd_send_readahead(dnbd);
+
+		/* delayed requests nobody else asked for are sent now */
+		req = dnbd_deq_request_due(&dnbd->delay_queue, &timeout);
+		if (!(delayed = (req != NULL)))
+			req = dnbd_try_deq_request(&dnbd->tx_queue, timeout);
 
 		if (!req)
 			continue;
 
 		/* request already in cache? */
-		cached = dnbd->cache.search(&dnbd->cache, req);
+		if (dnbd_cache_request(dnbd, req))
+			continue;
 
-		if (cached) {
-			if (!end_that_request_first(req, 1, cached)) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
-				end_that_request_last(req,1);
-#else
-				end_that_request_last(req);
-#endif
-			} else {
-				dnbd_enq_request(&dnbd->tx_queue, req, 1);
-			}
+		/* data read ahead is on its way */
+		if (!REQ_STATE(req)->retries
+		    && dnbd_ra_pending(&dnbd->ra, req->sector)) {
+			dnbd_wait_reply(dnbd, req, REQ_STATE(req)->server);
 			continue;
 		}
 
-		dnbd_enq_request(&dnbd->rx_queue, req, 0);
+		if (!delayed && dnbd_delay_request(dnbd, req))
+			continue;
+
 		result = dnbd_send_request(dnbd, req);
 	}
 
 	spin_lock(&dnbd->thread_lock);
-	dnbd->tx_thread.task = NULL;
+	thread->task = NULL;
 	spin_unlock(&dnbd->thread_lock);
 
-	dnbd_stop_thread(dnbd, &dnbd->tx_thread, 0);
-	complete(&dnbd->tx_thread.finish);
+	dnbd_stop_thread(dnbd, thread, 0);
+	complete(&thread->finish);
 	if (atomic_dec_and_test(&dnbd->num_io_threads))
 		dnbd_end_io(dnbd);
 
@@ -551,37 +1139,30 @@ static int dnbd_tx_loop(void *data)
 	return 0;
 }
 
-/* rexmit function is called periodically by kernel timer */
+/* rexmit function is called by kernel timer when a request is due */
 static void dnbd_rexmit(unsigned long arg)
 {
 	dnbd_device_t *dnbd = (dnbd_device_t *) arg;
-	unsigned long flags;
-	unsigned long timeout;
-
-	int requeued;
-
-	/* difference in jiffies for request timeout */
-	int diff = dnbd->servers.asrtt >> SRTT_SHIFT;
+	struct request *req;
+	long timeout;
 
-	/* just in case, give boundaries for request timeouts */
-	if (diff < dnbd->servers.timeout_min)
-		diff = dnbd->servers.timeout_min;
-	if (diff > dnbd->servers.timeout_max)
-		diff = dnbd->servers.timeout_max;
+	int requeued = 0;
 
-	timeout = jiffies - (diff << TIMEOUT_SHIFT);
+	/* only requests which timed out are touched, they back off */
+	while ((req = dnbd_deq_request_due(&dnbd->rx_queue, &timeout))) {
+		REQ_STATE(req)->retries++;
+		REQ_STATE(req)->ahead = 0;
+		dnbd_enq_request(&dnbd->tx_queue, req, 0);
+		dnbd_ra_timeout(&dnbd->ra);
+		requeued++;
+	}
 
-	requeued =
-	    dnbd_requeue_requests(&dnbd->tx_queue, &dnbd->rx_queue,
-				  timeout);
+	if (requeued)
+		wake_up(&dnbd->tx_queue.waiters);
 
-	/* set timer again in ASRTT jiffies for better granularity */
-	if (dnbd->state & DNBD_STATE_RUNNING) {
-		spin_lock_irqsave(&dnbd->timer_lock, flags);
-		dnbd->timer.expires = jiffies + diff;
-		add_timer(&dnbd->timer);
-		spin_unlock_irqrestore(&dnbd->timer_lock, flags);
-	}
+	/* set timer again to the deadline of the next request */
+	if (timeout != MAX_SCHEDULE_TIMEOUT)
+		dnbd_arm_timer(dnbd, jiffies + timeout);
 }
 
 /* session loop takes care of statistics */
@@ -589,6 +1170,7 @@ static int dnbd_ss_loop(void *data)
 {
 	dnbd_device_t *dnbd = (dnbd_device_t *) data;
 	int signr;
+	int ticks = 0;
 
 	__module_get(THIS_MODULE);
 	printk("ss_loop: enter\n");
@@ -604,10 +1186,14 @@ static int dnbd_ss_loop(void *data)
 
 	while ((signr = signal_pending(current)) == 0) {
 		set_current_state(TASK_INTERRUPTIBLE);
-		schedule_timeout(HZ * 4);	/* fixme: give user space option */
+		schedule_timeout(HZ);
 		set_current_state(TASK_RUNNING);
+		/* follow load of servers quickly */
 		dnbd_servers_weight(&dnbd->servers);
-		dnbd_send_hb(dnbd);
+		/* servers sending beacons need heartbeats only rarely */
+		if ((!(++ticks % 4) && dnbd_silent_servers(&dnbd->servers))
+		    || !(ticks % HB_ANNOUNCE))
+			dnbd_send_hb(dnbd);
 	}
 
 	spin_lock(&dnbd->thread_lock);
@@ -645,36 +1231,50 @@ static int dnbd_wait_threads_finished(dnbd_device_t * dnbd)
 	return signaled ? 0 : 1;
 }
 
-/* activate threads (rx_loop, tx_loop, ss_loop) */
+/* stop the first count tx_loops */
+static void dnbd_stop_tx_threads(dnbd_device_t * dnbd, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		dnbd_stop_thread(dnbd, &dnbd->tx_thread[i], 1);
+}
+
+/* activate threads (rx_loop, tx_loops, ss_loop) */
 static int dnbd_activate_threads(dnbd_device_t * dnbd)
 {
 	int result = -EINVAL;
+	int i;
 
 	printk(KERN_NOTICE "dnbd: activating threads...\n");
 	result = dnbd_start_thread(dnbd, &dnbd->rx_thread, dnbd_rx_loop);
 	if (result < 0)
 		return result;
 
-	result = dnbd_start_thread(dnbd, &dnbd->tx_thread, dnbd_tx_loop);
-	if (result < 0) {
-		dnbd_stop_thread(dnbd, &dnbd->rx_thread, 1);
-		return result;
+	for (i = 0; i < tx_threads; i++) {
+		result = dnbd_start_thread(dnbd, &dnbd->tx_thread[i],
+					   dnbd_tx_loop);
+		if (result < 0) {
+			dnbd_stop_thread(dnbd, &dnbd->rx_thread, 1);
+			dnbd_stop_tx_threads(dnbd, i);
+			return result;
+		}
 	}
 	result = dnbd_start_thread(dnbd, &dnbd->ss_thread, dnbd_ss_loop);
 	if (result < 0) {
 		dnbd_stop_thread(dnbd, &dnbd->rx_thread, 1);
-		dnbd_stop_thread(dnbd, &dnbd->tx_thread, 1);
+		dnbd_stop_tx_threads(dnbd, tx_threads);
 		return result;
 	}
 	return 0;
 }
 
-/* deactivate threads (rx_loop, tx_loop, ss_loop) */
+/* deactivate threads (rx_loop, tx_loops, ss_loop) */
 static int dnbd_deactivate_threads(dnbd_device_t * dnbd)
 {
 
 	printk(KERN_NOTICE "dnbd: deactivating threads...\n");
-	dnbd_stop_thread(dnbd, &dnbd->tx_thread, 1);
+	dnbd_stop_tx_threads(dnbd, tx_threads);
 	dnbd_stop_thread(dnbd, &dnbd->rx_thread, 1);
 	dnbd_stop_thread(dnbd, &dnbd->ss_thread, 1);
 	return 0;
@@ -694,6 +1294,7 @@ static int dnbd_startup(dnbd_device_t * dnbd)
 	}
 
 	dnbd->state = DNBD_STATE_RUNNING;
+	dnbd->peer_time = jiffies - PEER_TIMEOUT;
 
 	dnbd->timer.data = (unsigned long) dnbd;
 	dnbd->timer.function = dnbd_rexmit;
@@ -712,8 +1313,11 @@ static int dnbd_shutdown(dnbd_device_t * dnbd)
 	if (result < 0)
 		printk(KERN_NOTICE
 		       "dnbd_shutdown: ERROR deactivating threads!\n");
-	else
+	else {
 		dnbd->state &= ~DNBD_STATE_RUNNING;
+		/* threads may have set the timer again meanwhile */
+		del_timer_sync(&dnbd->timer);
+	}
 
 	return result;
 }
@@ -742,28 +1346,43 @@ static int dnbd_stop(dnbd_device_t * dnbd)
 /* function called by the kernel to make DNBD process a request */
 static void dnbd_do_request(request_queue_t * q)
 {
-	dnbd_device_t *dnbd = NULL;
-	int minor;
+	dnbd_device_t *dnbd = q->queuedata;
 
 	struct request *req;
+	struct dnbd_req *state;
 
 	/* as long as there are requests... */
 	while ((req = elv_next_request(q)) != NULL) {
 
+		/* 
+		   leave further requests to the elevator, which merges
+		   them until one of ours is completed
+		 */
+		if (dnbd->inflight >= queue_depth) {
+			blk_stop_queue(q);
+			break;
+		}
+
 		/* dequeue request from kernel queue */
 		blkdev_dequeue_request(req);
+		dnbd->inflight++;
+
+		/* 
+		   the block layer may reset req->errors when parts of a
+		   request end, state is kept in one of ours until it ends
+		 */
+		state = list_entry(dnbd->free_reqs.next, struct dnbd_req,
+				   list);
+		list_del(&state->list);
+		memset(state, 0, sizeof(*state));
+		state->sector = req->sector;
+		req->data = state;
+
 		if (!blk_fs_request(req)) {
 			printk(KERN_NOTICE "Skip non-CMD request\n");
 			goto error_out;
 		}
 
-		dnbd = req->rq_disk->private_data;
-		if (!dnbd) {
-			printk(KERN_ERR "dnbd: no private data\n");
-		}
-
-		minor = DEVICE_TO_MINOR(dnbd);
-
 		if (!(dnbd->state & DNBD_STATE_RUNNING))
 			goto error_out;
 
@@ -771,6 +1390,10 @@ static void dnbd_do_request(request_queue_t * q)
 			goto error_out;
 		}
 
+		/* follow sequential streams to read ahead */
+		dnbd_ra_read(&dnbd->ra, req->sector, req->nr_sectors,
+			     get_capacity(dnbd->disk));
+
 		/* 
 		   enqueue request to tx_queue, where it will be fetched
 		   by the tx_loop 
@@ -928,6 +1551,7 @@ static int dnbd_disconnect(dnbd_device_t * dnbd)
 	/* clean up */
 	dnbd_clear_sock(dnbd);
 	dnbd->cache.clean(&dnbd->cache);
+	dnbd_fec_clean(&dnbd->fec);
 	dnbd_clean_servers(&dnbd->servers);
 
 	result = 0;
@@ -1004,6 +1628,11 @@ static int dnbd_ioctl(struct inode *inode, struct file *file,
 	case DNBD_SET_SERVERID:
 		result = dnbd_set_serverid(&dnbd->servers, arg);
 		break;
+	case DNBD_SET_SERVER:
+		result =
+		    dnbd_set_server(&dnbd->servers,
+				    (struct dnbd_server_info __user *) arg);
+		break;
 	default:
 		result = -EINVAL;
 	}
@@ -1089,8 +1718,23 @@ dnbd_read_proc(char *buf, char **start, off_t offset,
 
 	len +=
 	    snprintf(buf + len, count - len,
-		     "Cache:\n hits %li\n miss %li\n lru replaced %li\n",
-		     dnbd->cache.hits, dnbd->cache.miss, dnbd->cache.lru);
+		     "Cache:\n hits %li\n miss %li\n lru replaced %li\n"
+		     " fills dropped %li\n", dnbd->cache.hits,
+		     dnbd->cache.miss, dnbd->cache.lru, dnbd->cache.dropped);
+
+	len +=
+	    snprintf(buf + len, count - len,
+		     "FEC:\n recovered %li\n lost %li\n",
+		     dnbd->fec.recovered, dnbd->fec.lost);
+
+	len +=
+	    snprintf(buf + len, count - len,
+		     "Requests:\n suppressed %li\n", dnbd->suppressed);
+
+	len +=
+	    snprintf(buf + len, count - len,
+		     "Read-ahead:\n sectors %li\n waited for %li\n",
+		     dnbd->ra.sectors, dnbd->ra.waited);
 
 	len += snprintf(buf + len, count - len, "Servers:\n");
 
@@ -1106,9 +1750,17 @@ dnbd_read_proc(char *buf, char **start, off_t offset,
 static int __init dnbd_init(void)
 {
 	int err = -ENOMEM;
-	int i = 0;
+	int i = 0, j;
 	char name[] = "dnbdxx";
 
+	/* keep module parameters within their limits */
+	if (queue_depth < 1)
+		queue_depth = 1;
+	if (tx_threads < 1)
+		tx_threads = 1;
+	if (tx_threads > MAX_TX_THREADS)
+		tx_threads = MAX_TX_THREADS;
+
 	if (!(dnbd_proc_dir = proc_mkdir("driver/dnbd", NULL))) {
 		printk(KERN_ERR
 		       "dnbd: can't create dir /proc/driver/dnbd\n");
@@ -1116,12 +1768,17 @@ static int __init dnbd_init(void)
 	}
 
 	for (i = 0; (i < MAX_DNBD && i < 100); i++) {
-		dnbd_dev[i] = vmalloc(sizeof(dnbd_device_t));
+		dnbd_dev[i] = vmalloc(sizeof(dnbd_device_t) +
+				      queue_depth * sizeof(struct dnbd_req));
 			if(!dnbd_dev[i]) {
 				printk(KERN_ERR "dnbd%d: Not enough memory\n",i);
 				goto out;
 			} else {
 				memset(dnbd_dev[i],0,sizeof(dnbd_device_t));
+				INIT_LIST_HEAD(&dnbd_dev[i]->free_reqs);
+				for (j = 0; j < queue_depth; j++)
+					list_add(&dnbd_dev[i]->reqs[j].list,
+						 &dnbd_dev[i]->free_reqs);
 			}
 	}
 	for (i = 0; (i < MAX_DNBD && i < 100); i++) {
@@ -1147,21 +1804,27 @@ static int __init dnbd_init(void)
 		dnbd_dev[i]->disk = disk;
 		/* 
 		 * initizialisation of request queue 
-		 * dnbd_do_request() is our function to handle the requests
+		 * dnbd_do_request() is our function to handle the requests,
+		 * it has a lock of its own to not contend with the threads
 		 */
+		spin_lock_init(&dnbd_dev[i]->queue_lock);
 		disk->queue =
 		    blk_init_queue(dnbd_do_request,
-				   &dnbd_dev[i]->thread_lock);
+				   &dnbd_dev[i]->queue_lock);
 
 		if (!disk->queue) {
 			printk(KERN_CRIT "dnbd: blk_init_queue failed\n");
 			put_disk(disk);
 			goto out;
 		}
+		disk->queue->queuedata = dnbd_dev[i];
 
 		/* read ahead */
 		disk->queue->backing_dev_info.ra_pages = 8;
 
+		/* sectors received ahead of a gap fit into a map */
+		blk_queue_max_sectors(disk->queue, MAX_REQ_SECTORS);
+
 	}
 
 	/* unregister_blkdev(DNBD_MAJOR, "dnbd"); */
@@ -1182,12 +1845,12 @@ static int __init dnbd_init(void)
 		init_timer(&dnbd_dev[i]->timer);
 
 		spin_lock_init(&dnbd_dev[i]->thread_lock);
-		spin_lock_init(&dnbd_dev[i]->queue_lock);
 		spin_lock_init(&dnbd_dev[i]->timer_lock);
 
 		/* initialize up rx&tx queue */
 		dnbd_dev[i]->rx_thread.task = NULL;
-		dnbd_dev[i]->tx_thread.task = NULL;
+		memset(dnbd_dev[i]->tx_thread, 0,
+		       sizeof(dnbd_dev[i]->tx_thread));
 		atomic_set(&dnbd_dev[i]->num_io_threads, 0);
 		init_waitqueue_head(&dnbd_dev[i]->io_waiters);
 		spin_lock_init(&dnbd_dev[i]->rx_queue.lock);
@@ -1196,6 +1859,9 @@ static int __init dnbd_init(void)
 		spin_lock_init(&dnbd_dev[i]->tx_queue.lock);
 		INIT_LIST_HEAD(&dnbd_dev[i]->tx_queue.head);
 		init_waitqueue_head(&dnbd_dev[i]->tx_queue.waiters);
+		spin_lock_init(&dnbd_dev[i]->delay_queue.lock);
+		INIT_LIST_HEAD(&dnbd_dev[i]->delay_queue.head);
+		init_waitqueue_head(&dnbd_dev[i]->delay_queue.waiters);
 
 		/* initialize device characteristics */
 		dnbd_dev[i]->file = NULL;
@@ -1205,7 +1871,7 @@ static int __init dnbd_init(void)
 		disk->major = dnbd_major;
 		disk->first_minor = i;
 		disk->fops = &dnbd_fops;
-		disk->private_data = &dnbd_dev[i];
+		disk->private_data = dnbd_dev[i];
 		disk->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO;
 		sprintf(disk->disk_name, "dnbd%d", i);
 		sprintf(disk->devfs_name, "dnbd/%d", i);
@@ -1214,6 +1880,12 @@ static int __init dnbd_init(void)
 		/* initialize cache */
 		dnbd_cache_init(&dnbd_dev[i]->cache);
 
+		/* initialize recovery of lost datagrams */
+		dnbd_fec_init(&dnbd_dev[i]->fec);
+
+		/* initialize read-ahead */
+		dnbd_ra_init(&dnbd_dev[i]->ra);
+
 		/* initialize servers */
 		dnbd_servers_init(&dnbd_dev[i]->servers);
 
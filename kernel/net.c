@@ -6,7 +6,10 @@
 #include <linux/errno.h>
 #include <linux/slab.h>
 #include <linux/random.h>
+#include <linux/sched.h>
+#include <asm/uaccess.h>
 
+#include "../common/dnbd-cliserv.h"
 #include "net.h"
 
 /* return pointer to server structure */
@@ -42,10 +45,24 @@ int dnbd_set_serverid(dnbd_servers_t * servers, int id)
 
 	server->state = SERVER_ACTIVE;
 	server->id = id;
-	server->srtt = servers->timeout_min;
+	server->srtt = jiffies_to_usecs(servers->timeout_min) << SRTT_SHIFT;
+	server->rttvar = jiffies_to_usecs(servers->timeout_min)
+	    << (RTTVAR_SHIFT - 1);
 	server->weight = 0;
 	server->last_rx = jiffies;
 	server->last_tx = jiffies;
+	server->busy = jiffies;
+	server->depth = 0;
+	server->service = 0;
+	server->hits = 0;
+	server->load_time = jiffies - LOAD_TIMEOUT;
+	server->xfersize = DNBD_XFER_MIN;
+	server->version = 0;
+	server->caps = 0;
+	server->seq_known = 0;
+	server->nack_map = 0;
+	server->nacks = 0;
+	server->suppressed = 0;
 
 	servers->count++;
 	result = 0;
@@ -53,25 +70,55 @@ int dnbd_set_serverid(dnbd_servers_t * servers, int id)
 	return result;
 }
 
-/* return server according to their weights (= probability) */
-int dnbd_next_server(dnbd_servers_t * servers)
+/* server has sent a busy reply recently? */
+static inline int dnbd_server_busy(dnbd_server_t * server)
+{
+	return time_before(jiffies, server->busy);
+}
+
+/* 
+ * return server according to their weights (= probability),
+ * server avoid is only returned if no other one is active
+ */
+int dnbd_next_server(dnbd_servers_t * servers, int avoid)
 {
 	int i;
-	char rnd;
+	unsigned char rnd;
 	dnbd_server_t *server = NULL;
 	int id = 0;
 	int weightsum = 0;
+	int idle = dnbd_idle_servers(servers);
 
 	/* get random byte from kernel */
 	get_random_bytes(&rnd, 1);
-	
+
 	for (i = 0; i < SERVERS_MAX; i++) {
 		server = &servers->serverlist[i];
-		if ((server->state == SERVER_ACTIVE)
-		    && ((weightsum += server->weight) > (unsigned char) rnd)) {
-			id = server->id;
-			    break;
-		    }
+		if ((server->state == SERVER_ACTIVE) && (server->id != avoid))
+			break;
+	}
+	if (i == SERVERS_MAX)
+		avoid = 0;
+
+	/* sum up weights of servers which may be asked */
+	for (i = 0; i < SERVERS_MAX; i++) {
+		server = &servers->serverlist[i];
+		if ((server->state == SERVER_ACTIVE) && (server->id != avoid)
+		    && !(idle && dnbd_server_busy(server)))
+			weightsum += server->weight;
+	}
+
+	/* scale random byte to the sum of weights */
+	weightsum = (weightsum * rnd) >> 8;
+
+	for (i = 0; i < SERVERS_MAX; i++) {
+		server = &servers->serverlist[i];
+		if ((server->state != SERVER_ACTIVE) || (server->id == avoid)
+		    || (idle && dnbd_server_busy(server)))
+			continue;
+		id = server->id;
+		if ((weightsum -= server->weight) < 0)
+			break;
 	}
 
 	/* alternatively, use server with highest weight */
@@ -85,6 +132,309 @@ int dnbd_next_server(dnbd_servers_t * servers)
 	return id;
 }
 
+/* server is overloaded, do not ask it for a while */
+void dnbd_busy_server(dnbd_servers_t * servers, int id, int depth)
+{
+	dnbd_server_t *server;
+
+	if (!(server = dnbd_get_server(servers, id)))
+		return;
+
+	server->depth = depth;
+	server->busy = jiffies + servers->timeout_busy;
+}
+
+/* remember load sent along with replies of a server */
+void dnbd_load_server(dnbd_servers_t * servers, int id, int depth,
+		      int service, int hits)
+{
+	dnbd_server_t *server;
+
+	if (!(server = dnbd_get_server(servers, id)))
+		return;
+
+	server->depth = depth;
+	server->service = service;
+	server->hits = hits;
+	server->load_time = jiffies;
+}
+
+/* 
+ * expected time in microseconds until a server answers, its round trip
+ * time plus waiting for its pending requests
+ */
+static inline int dnbd_server_cost(dnbd_server_t * server)
+{
+	int cost = server->srtt >> SRTT_SHIFT;
+
+	if (time_before(jiffies, server->load_time + LOAD_TIMEOUT))
+		cost += min(server->depth, LOAD_DEPTH_MAX) * server->service;
+
+	return (cost ? cost : 1);
+}
+
+/* set version and capabilities as announced by a server */
+void dnbd_set_caps(dnbd_servers_t * servers, int id, int version,
+		   u32 caps, int xfersize)
+{
+	dnbd_server_t *server;
+
+	if (!(server = dnbd_get_server(servers, id)))
+		return;
+
+	server->version = version;
+	server->caps = caps & DNBD_CAPS;
+
+	if (!(server->caps & DNBD_CAP_XFER) || (xfersize < DNBD_XFER_MIN))
+		xfersize = DNBD_XFER_MIN;
+	else if (xfersize > DNBD_XFER_MAX)
+		xfersize = DNBD_XFER_MAX;
+
+	server->xfersize = xfersize & ~((1 << 9) - 1);
+}
+
+/* add a server found by handshake in user space */
+int dnbd_set_server(dnbd_servers_t * servers,
+		    struct dnbd_server_info __user * arg)
+{
+	int result;
+	struct dnbd_server_info info;
+
+	if (copy_from_user(&info, arg, sizeof(info)))
+		return -EFAULT;
+
+	if ((result = dnbd_set_serverid(servers, info.id)) < 0)
+		return result;
+
+	dnbd_set_caps(servers, info.id, info.version, info.caps,
+		      info.xfersize);
+	return 0;
+}
+
+/* return maximum bytes per request for a server */
+int dnbd_xfersize(dnbd_servers_t * servers, int id)
+{
+	dnbd_server_t *server;
+
+	if (!(server = dnbd_get_server(servers, id)))
+		return DNBD_XFER_MIN;
+
+	return server->xfersize;
+}
+
+/* return capabilities of a server */
+u32 dnbd_server_caps(dnbd_servers_t * servers, int id)
+{
+	dnbd_server_t *server;
+
+	if (!(server = dnbd_get_server(servers, id)))
+		return 0;
+
+	return server->caps;
+}
+
+/* mark datagrams of a server as lost and report them later */
+static void dnbd_add_nack(dnbd_server_t * server, u32 seq, int count)
+{
+	int i, delay;
+	unsigned char rnd;
+
+	if (!server->nack_map) {
+		server->nack_seq = seq;
+		get_random_bytes(&rnd, 1);
+		delay = (server->srtt >> SRTT_SHIFT) / 2;
+		server->nack_time = jiffies + NACK_DELAY_MIN
+		    + usecs_to_jiffies((delay * rnd) >> 8);
+	}
+
+	/* larger gaps are left to retransmissions */
+	for (i = 0; i < count && i < DNBD_MAP_BLOCKS; i++) {
+		if ((u32) (seq + i - server->nack_seq) < DNBD_MAP_BLOCKS)
+			server->nack_map |=
+			    (u64) 1 << (seq + i - server->nack_seq);
+	}
+}
+
+/* datagrams of a server do not need to be reported anymore */
+static int dnbd_clear_nack(dnbd_server_t * server, u32 seq, u64 map)
+{
+	u64 old = server->nack_map;
+	int shift = (int) (seq - server->nack_seq);
+
+	if ((shift >= DNBD_MAP_BLOCKS) || (shift <= -DNBD_MAP_BLOCKS))
+		return 0;
+
+	server->nack_map &= ~(shift >= 0 ? map << shift : map >> -shift);
+	return (server->nack_map != old);
+}
+
+/* detect lost datagrams by sequence number of a received one */
+void dnbd_seq_server(dnbd_servers_t * servers, int id, u32 seq, int waiting)
+{
+	int diff;
+	dnbd_server_t *server;
+
+	if (!(server = dnbd_get_server(servers, id))
+	    || (server->state != SERVER_ACTIVE))
+		return;
+
+	diff = (int) (seq - server->seq);
+
+	/* first datagram or server restarted */
+	if (!server->seq_known || (diff >= SEQ_WINDOW)
+	    || (diff <= -SEQ_WINDOW)) {
+		server->seq_known = 1;
+		server->seq = seq + 1;
+		server->nack_map = 0;
+		return;
+	}
+
+	/* late datagram */
+	if (diff < 0) {
+		dnbd_clear_nack(server, seq, 1);
+		return;
+	}
+
+	/* only datagrams we may wait for are worth a NACK */
+	if (diff > 0 && waiting)
+		dnbd_add_nack(server, server->seq, diff);
+
+	server->seq = seq + 1;
+}
+
+/* another client has reported lost datagrams */
+void dnbd_suppress_nack(dnbd_servers_t * servers, int id, u32 seq, u64 map)
+{
+	dnbd_server_t *server;
+
+	if (!(server = dnbd_get_server(servers, id)) || !server->nack_map)
+		return;
+
+	if (dnbd_clear_nack(server, seq, map))
+		server->suppressed++;
+}
+
+/* return 1 and lost datagrams of a server if they are to be reported */
+int dnbd_next_nack(dnbd_servers_t * servers, int *id, u32 * seq, u64 * map)
+{
+	int i;
+	dnbd_server_t *server;
+
+	for (i = 0; i < SERVERS_MAX; i++) {
+		server = &servers->serverlist[i];
+		if (!server->nack_map
+		    || time_before(jiffies, server->nack_time))
+			continue;
+
+		*id = server->id;
+		*seq = server->nack_seq;
+		*map = server->nack_map;
+		server->nack_map = 0;
+		server->nacks++;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* return jiffies until next NACK is due */
+long dnbd_nack_timeout(dnbd_servers_t * servers)
+{
+	int i;
+	long timeout = MAX_SCHEDULE_TIMEOUT;
+	dnbd_server_t *server;
+
+	for (i = 0; i < SERVERS_MAX; i++) {
+		server = &servers->serverlist[i];
+		if (!server->nack_map)
+			continue;
+		if (time_before_eq(server->nack_time, jiffies))
+			return 0;
+		if ((long) (server->nack_time - jiffies) < timeout)
+			timeout = server->nack_time - jiffies;
+	}
+
+	return timeout;
+}
+
+/* average round trip time in jiffies within limits for timeouts */
+int dnbd_srtt_jiffies(dnbd_servers_t * servers)
+{
+	int diff = usecs_to_jiffies(servers->asrtt >> SRTT_SHIFT);
+
+	if (diff < servers->timeout_min)
+		diff = servers->timeout_min;
+	if (diff > servers->timeout_max)
+		diff = servers->timeout_max;
+
+	return diff;
+}
+
+/* 
+ * retransmit timeout in jiffies of a request sent to a server, SRTT
+ * plus four times RTTVAR, doubled for each time it timed out before
+ */
+long dnbd_rto_server(dnbd_servers_t * servers, int id, int retries)
+{
+	dnbd_server_t *server;
+	long rto;
+
+	if (!(server = dnbd_get_server(servers, id)))
+		rto = dnbd_srtt_jiffies(servers) << TIMEOUT_SHIFT;
+	else
+		rto = usecs_to_jiffies((server->srtt >> SRTT_SHIFT)
+				       + server->rttvar);
+
+	if (rto < servers->timeout_min << TIMEOUT_SHIFT)
+		rto = servers->timeout_min << TIMEOUT_SHIFT;
+	if (rto > servers->timeout_max << TIMEOUT_SHIFT)
+		rto = servers->timeout_max << TIMEOUT_SHIFT;
+
+	return rto << min(retries, RTO_BACKOFF_MAX);
+}
+
+/* random delay of a request before it is sent, in jiffies */
+long dnbd_request_delay(dnbd_servers_t * servers)
+{
+	unsigned char rnd;
+
+	get_random_bytes(&rnd, 1);
+	return REQUEST_DELAY_MIN
+	    + usecs_to_jiffies(((servers->asrtt >> SRTT_SHIFT) * rnd) >> 8);
+}
+
+/* return number of servers neither sending beacons nor replies */
+int dnbd_silent_servers(dnbd_servers_t * servers)
+{
+	int i, silent = 0;
+	dnbd_server_t *server;
+
+	for (i = 0; i < SERVERS_MAX; i++) {
+		server = &servers->serverlist[i];
+		if ((server->state != SERVER_INACTIVE)
+		    && time_after(jiffies, server->last_rx + BEACON_TIMEOUT))
+			silent++;
+	}
+
+	return silent;
+}
+
+/* return number of active servers which are not busy */
+int dnbd_idle_servers(dnbd_servers_t * servers)
+{
+	int i, idle = 0;
+	dnbd_server_t *server;
+
+	for (i = 0; i < SERVERS_MAX; i++) {
+		server = &servers->serverlist[i];
+		if ((server->state == SERVER_ACTIVE)
+		    && !dnbd_server_busy(server))
+			idle++;
+	}
+
+	return idle;
+}
+
 /* remove a server */
 void dnbd_rem_servers(dnbd_servers_t * servers)
 {
@@ -101,27 +451,31 @@ void dnbd_clean_servers(dnbd_servers_t * servers)
 	int i;
 	for (i = 0; i < SERVERS_MAX; i++) {
 		servers->serverlist[i].state = 0;
+		servers->serverlist[i].nack_map = 0;
 	}
 
 }
 
-/* update round trip time of a server */
+/* update round trip time of a server, rtt is in microseconds */
 void dnbd_rtt_server(dnbd_servers_t * servers, int id, int rtt)
 {
 	dnbd_server_t *server;
+	int err;
 
 	if (!(server = dnbd_get_server(servers, id)))
 		goto out;
 
-	if (rtt > servers->timeout_max)
-		rtt = TIMEOUT_MAX;
-	else if (rtt < servers->timeout_min)
-		rtt = TIMEOUT_MIN;
+	if (rtt > jiffies_to_usecs(servers->timeout_max))
+		rtt = jiffies_to_usecs(servers->timeout_max);
+	else if (rtt < 1)
+		rtt = 1;
 
 	down(&servers->sema);
-	server->srtt = ((SRTT_BETA * server->srtt
-			 + (((SRTT_BETA_BASE - SRTT_BETA) * rtt) << SRTT_SHIFT))
-			/ SRTT_BETA_BASE);
+	err = rtt - (server->srtt >> SRTT_SHIFT);
+	server->srtt += err;
+	if (err < 0)
+		err = -err;
+	server->rttvar += err - (server->rttvar >> RTTVAR_SHIFT);
 	up(&servers->sema);
 
       out:
@@ -134,9 +488,8 @@ void dnbd_servers_weight(dnbd_servers_t * servers)
 	int i;
 	int num_servers = 0;
 	long weightsum = 0;
-	long prod = 0;
 	long asrtt = 0;
-	int srtt = 0;
+	int cost = 0;
 	dnbd_server_t *server;
 
 	/* 
@@ -156,9 +509,8 @@ void dnbd_servers_weight(dnbd_servers_t * servers)
 				server->state = SERVER_STALLED;
 				continue;
 			}
-			srtt = (server->srtt ? server->srtt : 1);
-			weightsum += WEIGHT_FACTOR / srtt;
-			asrtt += srtt;
+			weightsum += WEIGHT_FACTOR / dnbd_server_cost(server);
+			asrtt += server->srtt;
 			num_servers++;
 		}
 	}
@@ -172,11 +524,13 @@ void dnbd_servers_weight(dnbd_servers_t * servers)
 		server = &servers->serverlist[i];
 
 		if (server->state == SERVER_ACTIVE) {
-			srtt = (server->srtt ? server->srtt : 1);
-			prod = srtt * weightsum;
+			cost = dnbd_server_cost(server);
 
-			if (prod > 0)
-				server->weight = WEIGHT_NORMAL * WEIGHT_FACTOR / prod;
+			/* share of 1 / cost in sum of all, microseconds
+			   would overflow the product of both */
+			if (weightsum > 0)
+				server->weight = WEIGHT_NORMAL
+				    * (WEIGHT_FACTOR / cost) / weightsum;
 			else
 				server->weight = WEIGHT_NORMAL / num_servers;
 		}
@@ -196,7 +550,7 @@ int dnbd_show_servers(dnbd_servers_t * servers, void *buf, int size)
 		      " timeout_min: %i jiffies\n timeout_max: %i jiffies\n",
 		      servers->timeout_min, servers->timeout_max);
 
-	n += snprintf(buf + n, size - n, "Average SRTT: %i\n",
+	n += snprintf(buf + n, size - n, "Average SRTT: %i us\n",
 		      servers->asrtt >> SRTT_SHIFT);
 
 	for (i = 0; i < SERVERS_MAX; i++) {
@@ -214,9 +568,29 @@ int dnbd_show_servers(dnbd_servers_t * servers, void *buf, int size)
 				      server->id);
 		}
 		n += snprintf(buf + n, size - n,
-			      " srtt: %i\n", server->srtt >> SRTT_SHIFT);
+			      " srtt: %i us, rttvar: %i us, rto: %li jiffies\n",
+			      server->srtt >> SRTT_SHIFT,
+			      server->rttvar >> RTTVAR_SHIFT,
+			      dnbd_rto_server(servers, server->id, 0));
+		n += snprintf(buf + n, size - n,
+			      " version: %i, caps: 0x%x\n", server->version,
+			      server->caps);
+		n += snprintf(buf + n, size - n,
+			      " xfersize: %i\n", server->xfersize);
 		n += snprintf(buf + n, size - n,
 			      " weight: %i (of %i)\n", server->weight,WEIGHT_NORMAL);
+		if (dnbd_server_busy(server))
+			n += snprintf(buf + n, size - n,
+				      " busy: %i pending requests\n",
+				      server->depth);
+		if (time_before(jiffies, server->load_time + LOAD_TIMEOUT))
+			n += snprintf(buf + n, size - n,
+				      " load: %i pending, %i us per read, "
+				      "%i%% cached\n", server->depth,
+				      server->service, server->hits);
+		n += snprintf(buf + n, size - n,
+			      " nacks: %i sent, %i suppressed\n",
+			      server->nacks, server->suppressed);
 	}
 
 	return n;
@@ -238,11 +612,13 @@ int dnbd_servers_init(dnbd_servers_t * servers)
 
 	for (i = 0; i < SERVERS_MAX; i++) {
 		servers->serverlist[i].state = 0;
+		servers->serverlist[i].nack_map = 0;
 	}
 
 	servers->count = 0;
 	servers->timeout_min = TIMEOUT_MIN;
 	servers->timeout_max = TIMEOUT_MAX;
 	servers->timeout_stalled = TIMEOUT_STALLED;
+	servers->timeout_busy = TIMEOUT_BUSY;
 	return 0;
 }
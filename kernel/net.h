@@ -6,6 +6,7 @@
 #include <linux/list.h>
 #include <linux/param.h>
 #include <linux/jiffies.h>
+#include <linux/time.h>
 
 #define 	SERVERS_MAX		8
 #define		SERVER_STALLED		-1
@@ -16,12 +17,42 @@
 #define		TIMEOUT_MIN		1
 #define		TIMEOUT_MAX		HZ / 4
 #define		TIMEOUT_STALLED		5 * HZ
+#define		TIMEOUT_BUSY		HZ / 2
 #define		TIMEOUT_SHIFT		2
 
-/* beta is 99% (990/1000) */
-#define		SRTT_BETA		990
-#define		SRTT_BETA_BASE		1000	
-#define		SRTT_SHIFT		10
+/* 
+ * lost datagrams are reported after a random delay of up to half a
+ * round trip, gaps of more than SEQ_WINDOW datagrams resynchronize
+ */
+#define		NACK_DELAY_MIN		1
+#define		SEQ_WINDOW		4096
+
+/* 
+ * load of a server counts for weights until it is older than
+ * LOAD_TIMEOUT, at most LOAD_DEPTH_MAX pending requests are waited for
+ */
+#define		LOAD_TIMEOUT		8 * HZ
+#define		LOAD_DEPTH_MAX		256
+
+/* 
+ * while requests of other clients were heard within PEER_TIMEOUT,
+ * requests wait for a random delay of up to a round trip first
+ */
+#define		REQUEST_DELAY_MIN	1
+#define		PEER_TIMEOUT		2 * HZ
+
+/* heartbeats are only sent if a server was not heard for this time */
+#define		BEACON_TIMEOUT		3 * HZ
+
+/* 
+ * SRTT and RTTVAR are estimated as by Jacobson/Karels with gains of
+ * 1/8 and 1/4, they are kept in microseconds << their shift
+ */
+#define		SRTT_SHIFT		3
+#define		RTTVAR_SHIFT		2
+
+/* timeout of a request doubles with each retry up to this shift */
+#define		RTO_BACKOFF_MAX		3
 
 /* normalize weights to 255 as there is no float arithmetic in kernel */
 #define		WEIGHT_NORMAL		((1<<8)-1)
@@ -37,10 +68,26 @@ if ((id > 0) && (id <= SERVERS_MAX)) servers.serverlist[id-1].last_tx = jiffies;
 struct dnbd_server {
 	int id;
 	int state;
-	int srtt;
+	int srtt;			/* in microseconds << SRTT_SHIFT */
+	int rttvar;			/* in microseconds << RTTVAR_SHIFT */
 	int weight;
 	unsigned long last_rx;		/* in jiffies */
 	unsigned long last_tx;		/* in jiffies */
+	unsigned long busy;		/* avoid server until, in jiffies */
+	int depth;			/* queue depth reported by server */
+	int service;			/* microseconds to read 4 KiB */
+	int hits;			/* percentage of reads from memory */
+	unsigned long load_time;	/* load reported at, in jiffies */
+	int xfersize;			/* maximum bytes per request */
+	int version;			/* protocol version */
+	u32 caps;			/* negotiated capabilities */
+	int seq_known;			/* seq is valid */
+	u32 seq;			/* next expected sequence number */
+	u32 nack_seq;			/* sequence number of bit 0 of map */
+	u64 nack_map;			/* lost datagrams not reported yet */
+	unsigned long nack_time;	/* report them at, in jiffies */
+	int nacks;			/* NACKs sent */
+	int suppressed;			/* NACKs of other clients heard */
 };
 
 typedef struct dnbd_server dnbd_server_t;
@@ -54,17 +101,45 @@ struct dnbd_servers {
 	int timeout_min;
 	int timeout_max;
 	int timeout_stalled;
+	int timeout_busy;
 	int asrtt;
 	int count;
 };
 
 typedef struct dnbd_servers dnbd_servers_t;
+
+/* timestamp for round trip times, wraps after 71 minutes */
+static inline u32 dnbd_usecs(void)
+{
+	struct timeval tv;
+
+	do_gettimeofday(&tv);
+	return tv.tv_sec * USEC_PER_SEC + tv.tv_usec;
+}
 	
 /* functions */
 int dnbd_set_serverid(dnbd_servers_t * servers, int id);
-int dnbd_next_server(dnbd_servers_t * servers);
+int dnbd_next_server(dnbd_servers_t * servers, int avoid);
 void dnbd_rem_servers(dnbd_servers_t * servers);
 void dnbd_rtt_server(dnbd_servers_t * servers, int id, int rtt);
+void dnbd_busy_server(dnbd_servers_t * servers, int id, int depth);
+void dnbd_load_server(dnbd_servers_t * servers, int id, int depth,
+		      int service, int hits);
+void dnbd_set_caps(dnbd_servers_t * servers, int id, int version,
+		   u32 caps, int xfersize);
+int dnbd_set_server(dnbd_servers_t * servers,
+		    struct dnbd_server_info __user * arg);
+int dnbd_xfersize(dnbd_servers_t * servers, int id);
+u32 dnbd_server_caps(dnbd_servers_t * servers, int id);
+int dnbd_idle_servers(dnbd_servers_t * servers);
+int dnbd_silent_servers(dnbd_servers_t * servers);
+void dnbd_seq_server(dnbd_servers_t * servers, int id, u32 seq, int waiting);
+void dnbd_suppress_nack(dnbd_servers_t * servers, int id, u32 seq, u64 map);
+int dnbd_next_nack(dnbd_servers_t * servers, int *id, u32 * seq, u64 * map);
+long dnbd_nack_timeout(dnbd_servers_t * servers);
+long dnbd_request_delay(dnbd_servers_t * servers);
+int dnbd_srtt_jiffies(dnbd_servers_t * servers);
+long dnbd_rto_server(dnbd_servers_t * servers, int id, int retries);
 int dnbd_servers_init(dnbd_servers_t *servers);
 void dnbd_servers_weight(dnbd_servers_t * servers);
 int dnbd_show_servers(dnbd_servers_t * servers, void *buf, int size);
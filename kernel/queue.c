@@ -10,42 +10,174 @@
 #include <linux/fs.h>
 
 #include <linux/spinlock.h>
+#include <linux/hash.h>
 
 #include <linux/in.h>
 
 #include "dnbd.h"
 #include "queue.h"
 
+/* hash chain of requests starting at a sector */
+static inline struct request **dnbd_hash_chain(dnbd_queue_t * q,
+					       sector_t sector)
+{
+	return &q->hash[hash_long((unsigned long) sector, QUEUE_HASH_BITS)];
+}
+
+/* add request to queue in front of next, lock must be held */
+static void dnbd_add_request(dnbd_queue_t * q, struct request *req,
+			     struct list_head *next)
+{
+	struct request **chain = dnbd_hash_chain(q, req->sector);
+
+	list_add_tail(&req->queuelist, next);
+	req->special = *chain;
+	*chain = req;
+}
+
+/* remove request from queue, lock must be held */
+static void dnbd_del_request(dnbd_queue_t * q, struct request *req)
+{
+	struct request **chain = dnbd_hash_chain(q, req->sector);
+
+	while (*chain != req)
+		chain = (struct request **) &(*chain)->special;
+	*chain = req->special;
+	req->special = NULL;
+	list_del_init(&req->queuelist);
+}
+
 /* enqueue to a queue */
 void dnbd_enq_request(dnbd_queue_t * q, struct request *req, int wakeup)
 {
 	unsigned long flags;
 	spin_lock_irqsave(&q->lock, flags);
-	list_add(&req->queuelist, &q->head);
+	dnbd_add_request(q, req, q->head.next);
 	spin_unlock_irqrestore(&q->lock,flags);
 	if (wakeup)
 		wake_up(&q->waiters);
 }
 
+/* 
+ * enqueue ordered by start_time, so requests are dequeued when they
+ * are due, new requests are usually due last and are added at once
+ */
+void dnbd_enq_request_sorted(dnbd_queue_t * q, struct request *req,
+			     int wakeup)
+{
+	struct list_head *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	list_for_each(tmp, &q->head) {
+		if (!time_after(blkdev_entry_to_request(tmp)->start_time,
+				req->start_time))
+			break;
+	}
+	dnbd_add_request(q, req, tmp);
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (wakeup)
+		wake_up(&q->waiters);
+}
+
 /* dequeue from a queue with position */
 struct request *dnbd_deq_request_handle(dnbd_queue_t * q, uint64_t pos)
+{
+	struct request *req;
+	sector_t sector = pos >> 9;
+	unsigned long flags;
+
+	/* requests start at whole sectors */
+	if (pos & 511)
+		return NULL;
+
+	spin_lock_irqsave(&q->lock,flags);
+	for (req = *dnbd_hash_chain(q, sector); req; req = req->special) {
+		if (req->sector == sector) {
+			dnbd_del_request(q, req);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&q->lock,flags);
+	return req;
+}
+
+/* 
+ * dequeue a request overlapping the sectors [start, end), requests
+ * start at blocks of mask + 1 sectors and are looked up by position
+ */
+struct request *dnbd_deq_request_overlap(dnbd_queue_t * q, sector_t start,
+					 sector_t end, sector_t mask)
+{
+	struct request *req = NULL;
+	sector_t sector = 0;
+	unsigned long flags;
+
+	/* first block a request reaching start may begin at */
+	if (start >= MAX_REQ_SECTORS)
+		sector = (start - MAX_REQ_SECTORS + 1 + mask) & ~mask;
+
+	spin_lock_irqsave(&q->lock, flags);
+	for (; sector < end; sector += mask + 1) {
+		for (req = *dnbd_hash_chain(q, sector); req;
+		     req = req->special) {
+			if ((req->sector == sector)
+			    && (req->sector + req->nr_sectors > start)) {
+				dnbd_del_request(q, req);
+				goto out;
+			}
+		}
+	}
+      out:
+	spin_unlock_irqrestore(&q->lock, flags);
+	return req;
+}
+
+/* dequeue a request lying within [start, end) aligned to mask + 1 sectors */
+struct request *dnbd_deq_request_range(dnbd_queue_t * q, sector_t start,
+				       sector_t end, sector_t mask)
 {
 	struct request *req = NULL;
 	struct list_head *tmp;
-		unsigned long flags;
+	unsigned long flags;
 
-	spin_lock_irqsave(&q->lock,flags);
+	spin_lock_irqsave(&q->lock, flags);
 	list_for_each(tmp, &q->head) {
 		req = blkdev_entry_to_request(tmp);
-		if (((u64) req->sector) << 9 == pos) {
-			list_del_init(&req->queuelist);
+		if ((req->sector >= start)
+		    && (req->sector + req->nr_sectors <= end)
+		    && !(req->sector & mask) && !(req->nr_sectors & mask)) {
+			dnbd_del_request(q, req);
 			goto out;
 		}
-
 	}
 	req = NULL;
       out:
-	spin_unlock_irqrestore(&q->lock,flags);
+	spin_unlock_irqrestore(&q->lock, flags);
+	return req;
+}
+
+/* 
+ * dequeue a request of a sorted queue whose start_time has passed,
+ * otherwise timeout gets the jiffies until the next one is due
+ */
+struct request *dnbd_deq_request_due(dnbd_queue_t * q, long *timeout)
+{
+	struct request *req = NULL;
+	unsigned long flags;
+
+	*timeout = MAX_SCHEDULE_TIMEOUT;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (!list_empty(&q->head)) {
+		req = blkdev_entry_to_request(q->head.prev);
+		if (time_after(req->start_time, jiffies)) {
+			*timeout = req->start_time - jiffies;
+			req = NULL;
+		} else
+			dnbd_del_request(q, req);
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
 	return req;
 }
 
@@ -58,14 +190,14 @@ struct request *dnbd_deq_request(dnbd_queue_t * q)
 	spin_lock_irqsave(&q->lock, flags);
 	if (!list_empty(&q->head)) {
 		req = blkdev_entry_to_request(q->head.prev);
-		list_del_init(&req->queuelist);
+		dnbd_del_request(q, req);
 	}
 	spin_unlock_irqrestore(&q->lock, flags);
 	return req;
 }
 
-/* sleep until request can be dequeued */
-struct request *dnbd_try_deq_request(dnbd_queue_t * q)
+/* sleep until request can be dequeued or timeout jiffies passed */
+struct request *dnbd_try_deq_request(dnbd_queue_t * q, long timeout)
 {
 	struct request *req;
 
@@ -82,10 +214,10 @@ struct request *dnbd_try_deq_request(dnbd_queue_t * q)
 			set_current_state(TASK_INTERRUPTIBLE);
 			req = dnbd_deq_request(q);
 
-			if (req || signal_pending(current))
+			if (req || signal_pending(current) || !timeout)
 				break;
 
-			schedule();
+			timeout = schedule_timeout(timeout);
 		}
 
 		set_current_state(TASK_RUNNING);
@@ -94,33 +226,3 @@ struct request *dnbd_try_deq_request(dnbd_queue_t * q)
 
 	return req;
 }
-
-/* requeue requests with timeout */
-int dnbd_requeue_requests(dnbd_queue_t * to, dnbd_queue_t * from,
-			  unsigned long timeout)
-{
-	struct request *req = NULL;
-	struct list_head *tmp, *keep;
-	int requeued = 0;
-	unsigned long flags;
-
-	spin_lock_irqsave(&from->lock,flags);
-
-	list_for_each_safe(tmp, keep, &from->head) {
-		req = blkdev_entry_to_request(tmp);
-		if (req->start_time < timeout) {
-			requeued++;
-			list_del_init(&req->queuelist);
-
-			spin_lock_irqsave(&to->lock,flags);
-			list_add(&req->queuelist, &to->head);
-			spin_unlock_irqrestore(&to->lock,flags);
-		}
-	}
-
-	spin_unlock_irqrestore(&from->lock,flags);
-
-	wake_up(&to->waiters);
-
-	return requeued;
-}
@@ -6,23 +6,37 @@
 #include <linux/list.h>
 #include <linux/wait.h>
 
+/* 
+ * requests of a queue are also found by position in a hash table,
+ * chained through req->special, which is unused for fs requests
+ */
+#define QUEUE_HASH_BITS		8
+#define QUEUE_HASH_SIZE		(1 << QUEUE_HASH_BITS)
+
 /* queue structure used for rx_queue and tx_queue */
 struct dnbd_queue {
 	spinlock_t lock;
 	struct semaphore sema;
 	struct list_head head;
 	wait_queue_head_t waiters;
+	struct request *hash[QUEUE_HASH_SIZE];
 };
 
 typedef struct dnbd_queue dnbd_queue_t;
 
 /* functions */
 void dnbd_enq_request(dnbd_queue_t * q, struct request *req, int wakeup);
+void dnbd_enq_request_sorted(dnbd_queue_t * q, struct request *req,
+			     int wakeup);
 struct request *dnbd_deq_request(dnbd_queue_t * q);
 struct request *dnbd_deq_request_handle(dnbd_queue_t * q, uint64_t pos);
-struct request *dnbd_try_deq_request(dnbd_queue_t * q);
+struct request *dnbd_deq_request_overlap(dnbd_queue_t * q, sector_t start,
+					 sector_t end, sector_t mask);
+struct request *dnbd_deq_request_range(dnbd_queue_t * q, sector_t start,
+				       sector_t end, sector_t mask);
+struct request *dnbd_deq_request_due(dnbd_queue_t * q, long *timeout);
+struct request *dnbd_try_deq_request(dnbd_queue_t * q, long timeout);
 void dnbd_mark_old_requests(dnbd_queue_t * q);
-int dnbd_requeue_requests(dnbd_queue_t * to, dnbd_queue_t * from, unsigned long timeout);
 void dnbd_error_old_requests(dnbd_queue_t * q);
 
 
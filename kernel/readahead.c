@@ -0,0 +1,204 @@
+/*
+ * readahead.c - adaptive read-ahead of sequential streams into the cache
+ */
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/string.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+
+#include "readahead.h"
+
+void dnbd_ra_init(dnbd_ra_t * ra)
+{
+	memset(ra, 0, sizeof(*ra));
+	spin_lock_init(&ra->lock);
+}
+
+/* 
+ * note a read of the block layer, a read following a stream continues
+ * it, any other read replaces the stream read least recently
+ */
+void dnbd_ra_read(dnbd_ra_t * ra, sector_t sector, unsigned int count,
+		  sector_t capacity)
+{
+	struct dnbd_ra_stream *stream, *lru = NULL;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&ra->lock, flags);
+
+	for (i = 0; i < RA_STREAMS; i++) {
+		stream = &ra->streams[i];
+		if (stream->window && (stream->next == sector))
+			goto found;
+		if (!lru || time_before(stream->time, lru->time))
+			lru = stream;
+	}
+
+	/* random reads are not read ahead */
+	memset(lru, 0, sizeof(*lru));
+	lru->next = sector + count;
+	lru->window = RA_MIN;
+	lru->timeouts = ra->timeouts;
+	lru->time = jiffies;
+	goto out;
+
+      found:
+	stream->next = sector + count;
+	stream->time = jiffies;
+	stream->hits++;
+
+	if (stream->hits < RA_GROW)
+		goto out;
+
+	/* ask for more when half of the window is read */
+	if ((stream->end > stream->next)
+	    && (stream->end - stream->next > stream->window / 2))
+		goto out;
+
+	/* 
+	   grow window while the network keeps up, shrink it otherwise,
+	   the first window is taken as it is
+	 */
+	if (stream->end && (stream->timeouts != ra->timeouts)) {
+		stream->timeouts = ra->timeouts;
+		stream->window = max(stream->window / 2, RA_MIN);
+	} else if (stream->end)
+		stream->window = min(stream->window * 2, RA_MAX);
+
+	if (stream->sent < stream->next)
+		stream->sent = stream->next;
+	stream->end = stream->next + stream->window;
+	if (stream->end > capacity)
+		stream->end = capacity;
+
+      out:
+	spin_unlock_irqrestore(&ra->lock, flags);
+}
+
+/* chunk in flight, lock must be held */
+static inline int dnbd_ra_inflight(struct dnbd_ra_chunk *chunk)
+{
+	return chunk->count && time_before(jiffies, chunk->time + RA_EXPIRE);
+}
+
+/* any stream to be read ahead? */
+int dnbd_ra_wanted(dnbd_ra_t * ra)
+{
+	int i;
+
+	/* a stale answer only delays read-ahead to the next call */
+	for (i = 0; i < RA_STREAMS; i++) {
+		if (ra->streams[i].sent < ra->streams[i].end)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* 
+ * take up to max sectors to be read ahead, returns 0 if there are none
+ * or too many chunks are in flight
+ */
+int dnbd_ra_next(dnbd_ra_t * ra, sector_t * sector, unsigned int *count,
+		 unsigned int max)
+{
+	struct dnbd_ra_stream *stream;
+	struct dnbd_ra_chunk *chunk = NULL;
+	unsigned long flags;
+	int i, result = 0;
+
+	spin_lock_irqsave(&ra->lock, flags);
+
+	for (i = 0; i < RA_CHUNKS; i++) {
+		if (!dnbd_ra_inflight(&ra->chunks[i])) {
+			chunk = &ra->chunks[i];
+			break;
+		}
+	}
+	if (!chunk)
+		goto out;
+
+	for (i = 0; i < RA_STREAMS; i++) {
+		stream = &ra->streams[i];
+		if (stream->sent >= stream->end)
+			continue;
+		*sector = stream->sent;
+		*count = min_t(sector_t, stream->end - stream->sent, max);
+		stream->sent += *count;
+		ra->sectors += *count;
+		chunk->sector = *sector;
+		chunk->count = *count;
+		chunk->time = jiffies;
+		result = 1;
+		break;
+	}
+
+      out:
+	spin_unlock_irqrestore(&ra->lock, flags);
+	return result;
+}
+
+/* sector was asked for ahead and its data may still arrive? */
+int dnbd_ra_pending(dnbd_ra_t * ra, sector_t sector)
+{
+	struct dnbd_ra_chunk *chunk;
+	unsigned long flags;
+	int i, result = 0;
+
+	spin_lock_irqsave(&ra->lock, flags);
+
+	for (i = 0; i < RA_CHUNKS; i++) {
+		chunk = &ra->chunks[i];
+		if (dnbd_ra_inflight(chunk) && (sector >= chunk->sector)
+		    && (sector < chunk->sector + chunk->count)) {
+			ra->waited++;
+			result = 1;
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&ra->lock, flags);
+	return result;
+}
+
+/* 
+ * data of count sectors arrived or was given up, a chunk keeps only
+ * the sectors in front of them, which may still arrive
+ */
+void dnbd_ra_done(dnbd_ra_t * ra, sector_t sector, unsigned int count)
+{
+	struct dnbd_ra_chunk *chunk;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&ra->lock, flags);
+
+	for (i = 0; i < RA_CHUNKS; i++) {
+		chunk = &ra->chunks[i];
+		if (!chunk->count || (sector + count <= chunk->sector)
+		    || (sector >= chunk->sector + chunk->count))
+			continue;
+		if (sector > chunk->sector)
+			chunk->count = sector - chunk->sector;
+		else if (sector + count < chunk->sector + chunk->count) {
+			chunk->count -= sector + count - chunk->sector;
+			chunk->sector = sector + count;
+		} else
+			chunk->count = 0;
+	}
+
+	spin_unlock_irqrestore(&ra->lock, flags);
+}
+
+/* a request timed out, the network does not keep up */
+void dnbd_ra_timeout(dnbd_ra_t * ra)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	ra->timeouts++;
+	spin_unlock_irqrestore(&ra->lock, flags);
+}
@@ -0,0 +1,60 @@
+#ifndef LINUX_DNBD_READAHEAD_H
+#define LINUX_DNBD_READAHEAD_H	1
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* sequential streams followed per device */
+#define RA_STREAMS		4
+/* sequential reads of a stream before it is read ahead */
+#define RA_GROW			2
+/* sectors read ahead at first and at most */
+#define RA_MIN			64
+#define RA_MAX			2048
+/* chunks read ahead whose data may still arrive */
+#define RA_CHUNKS		32
+/* chunks are given up if their data did not arrive within, in jiffies */
+#define RA_EXPIRE		HZ
+
+/* a stream of sequential reads */
+struct dnbd_ra_stream {
+	sector_t next;			/* sector following the last read */
+	sector_t sent;			/* sectors up to here are asked for */
+	sector_t end;			/* read ahead up to here */
+	int window;			/* sectors read ahead at once */
+	int hits;			/* sequential reads */
+	int timeouts;			/* timeouts when window was set */
+	unsigned long time;		/* last read, in jiffies */
+};
+
+/* sectors asked for ahead whose data did not arrive yet */
+struct dnbd_ra_chunk {
+	sector_t sector;
+	unsigned int count;		/* 0 if unused */
+	unsigned long time;		/* sent at, in jiffies */
+};
+
+/* read-ahead of a device */
+struct dnbd_ra {
+	spinlock_t lock;
+	int timeouts;			/* requests timed out */
+	struct dnbd_ra_stream streams[RA_STREAMS];
+	struct dnbd_ra_chunk chunks[RA_CHUNKS];
+	long sectors;			/* statistics */
+	long waited;
+};
+
+typedef struct dnbd_ra dnbd_ra_t;
+
+/* functions */
+void dnbd_ra_init(dnbd_ra_t * ra);
+void dnbd_ra_read(dnbd_ra_t * ra, sector_t sector, unsigned int count,
+		  sector_t capacity);
+int dnbd_ra_wanted(dnbd_ra_t * ra);
+int dnbd_ra_next(dnbd_ra_t * ra, sector_t * sector, unsigned int *count,
+		 unsigned int max);
+int dnbd_ra_pending(dnbd_ra_t * ra, sector_t sector);
+void dnbd_ra_done(dnbd_ra_t * ra, sector_t sector, unsigned int count);
+void dnbd_ra_timeout(dnbd_ra_t * ra);
+
+#endif				/* LINUX_DNBD_READAHEAD_H */
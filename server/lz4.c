@@ -0,0 +1,120 @@
+/*
+ * lz4.c - compression of blocks in LZ4 block format
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define LZ4_HASH_BITS		12
+#define LZ4_MIN_MATCH		4
+/* last bytes of a block are always literals */
+#define LZ4_LAST_LITERALS	5
+/* last match must start this many bytes before end of block */
+#define LZ4_MF_LIMIT		12
+
+static inline uint32_t lz4_read32(const uint8_t * p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline int lz4_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* 
+ * function lz4_sequence(): write literals and a match (if mlen > 0)
+ * returns: end of output or NULL if output buffer is too small
+ */
+static uint8_t *lz4_sequence(uint8_t * op, uint8_t * oend,
+			     const uint8_t * anchor, size_t lit,
+			     size_t offset, size_t mlen)
+{
+	uint8_t *token;
+	size_t n;
+
+	/* worst case of token, lengths, literals and offset */
+	if (op + 1 + (lit / 255 + 1) + lit + 2 + (mlen / 255 + 1) > oend)
+		return NULL;
+
+	token = op++;
+	*token = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15) {
+		for (n = lit - 15; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = n;
+	}
+
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	if (!mlen)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+
+	mlen -= LZ4_MIN_MATCH;
+	*token |= (mlen < 15 ? mlen : 15);
+	if (mlen >= 15) {
+		for (n = mlen - 15; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = n;
+	}
+
+	return op;
+}
+
+/* 
+ * function lz4_compress(): compress a block with greedy matching
+ * returns: size of compressed block or 0 if it does not fit into max
+ */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t max)
+{
+	const uint8_t *in = src;
+	const uint8_t *ip = in, *anchor = in, *ref;
+	const uint8_t *iend = in + len;
+	uint8_t *op = dst, *oend = op + max;
+	uint16_t table[1 << LZ4_HASH_BITS];
+	size_t mlen;
+	int h;
+
+	if (len > LZ4_MAX_INPUT)
+		return 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (len > LZ4_MF_LIMIT && ip < iend - LZ4_MF_LIMIT) {
+		h = lz4_hash(lz4_read32(ip));
+		ref = in + table[h];
+		table[h] = ip - in;
+
+		if ((ref >= ip) || (lz4_read32(ref) != lz4_read32(ip))) {
+			ip++;
+			continue;
+		}
+
+		/* extend match, keeping the last literals */
+		for (mlen = LZ4_MIN_MATCH;
+		     (ip + mlen < iend - LZ4_LAST_LITERALS)
+		     && (ip[mlen] == ref[mlen]); mlen++);
+
+		if (!(op = lz4_sequence(op, oend, anchor, ip - anchor,
+					ip - ref, mlen)))
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	/* remaining literals */
+	if (!(op = lz4_sequence(op, oend, anchor, iend - anchor, 0, 0)))
+		return 0;
+
+	return op - (uint8_t *) dst;
+}
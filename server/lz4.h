@@ -0,0 +1,12 @@
+#ifndef LINUX_DNBD_LZ4_H
+#define LINUX_DNBD_LZ4_H	1
+
+#include <sys/types.h>
+
+/* largest input of a block, offsets must fit into 16 bits */
+#define LZ4_MAX_INPUT		65536
+
+/* functions */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t max);
+
+#endif
@@ -40,6 +40,23 @@ void net_tx(net_info_t * net_info, net_reply_t * reply)
 
 }
 
+/* 
+ * function net_txv(): send a server reply gathered from several buffers
+ */
+void net_txv(net_info_t * net_info, struct iovec *iov, int count)
+{
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &net_info->groupnet;
+	msg.msg_namelen = sizeof(net_info->groupnet);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+
+	if (sendmsg(net_info->sock, &msg, 0) < 0)
+		fprintf(stderr, "net_txv: mcast sendproblem\n");
+}
+
 /* 
  * function net_rx(): receive a client request 
  * returns: 1 on correct size of reply, otherwise 0
@@ -47,22 +64,42 @@ void net_tx(net_info_t * net_info, net_reply_t * reply)
 int net_rx(net_info_t * net_info, net_request_t * request)
 {
 	ssize_t n;
+	unsigned char buf[sizeof(request->data) + sizeof(request->usec)];
 
 	request->clientlen = sizeof(request->client);
 
-	n = recvfrom(net_info->sock, &request->data,
-		     sizeof(request->data), 0,
+	n = recvfrom(net_info->sock, buf, sizeof(buf), 0,
 		     &request->client, &request->clientlen);
 
+	if (n < (ssize_t) sizeof(dnbd_request_t))
+		return 0;
+
+	/* timestamp ends the request */
+	if (ntohs(((dnbd_request_t *) buf)->cmd) & DNBD_CMD_USEC) {
+		n -= sizeof(request->usec);
+		memcpy(&request->usec, buf + n, sizeof(request->usec));
+	}
+
+	if (n > sizeof(request->data))
+		return 0;
+
+	memcpy(&request->data, buf, n);
+	request->len = n;
+
 	/* sizeof of request must be size of a DNBD request */
-	return (n == sizeof(request->data) ? 1 : 0);
+	if (n == sizeof(dnbd_request_t))
+		return 1;
+
+	/* or of a multi-block read request */
+	return ((n == sizeof(dnbd_request_map_t))
+		&& (ntohs(request->data.cmd) & DNBD_CMD_MAP) ? 1 : 0);
 }
 
 /* 
  * function net_init(): initialize network for multicast 
  * returns: structure with network related information
  */
-net_info_t *net_init(const char *mnet)
+net_info_t *net_init(const char *mnet, int mtu)
 {
 	struct ip_mreq mreq;
 	const int ttl = 64;	/* TTL of 64 should be enough */
@@ -76,6 +113,16 @@ net_info_t *net_init(const char *mnet)
 
 	memset(net_info, 0, sizeof(net_info_t));
 
+	/* 
+	   fill a frame with as many blocks as possible, larger replies
+	   are split into several datagrams; datagrams of a single block
+	   are fragmented by IP on small MTUs
+	 */
+	net_info->datagram = DNBD_XFER_MIN;
+	while ((net_info->datagram << 1) + sizeof(dnbd_reply_t)
+	       + NET_HEADERS <= mtu)
+		net_info->datagram <<= 1;
+
 	/* network setup */
 	net_info->server.sin_family = AF_INET;
 	net_info->server.sin_port = htons(DNBD_PORT);
@@ -3,13 +3,20 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
+/* default MTU of network */
+#define NET_MTU			1500
+/* size of IP and UDP headers */
+#define NET_HEADERS		28
+
 /* network information */
 struct net_info {
 	int sock;
 	struct sockaddr_in server;
 	struct sockaddr_in groupnet;
+	size_t datagram;	/* maximum payload of reply datagram */
 };
 typedef struct net_info net_info_t;
 	
@@ -17,8 +24,9 @@ typedef struct net_info net_info_t;
 struct net_request {
 	struct sockaddr_in client;
 	socklen_t clientlen;
-	dnbd_request_t data;
+	dnbd_request_map_t data;	/* or shorter dnbd_request_t */
 	size_t len;
+	dnbd_trailer_usec_t usec;	/* timestamp of DNBD_CMD_USEC */
 };
 typedef struct net_request net_request_t;
 
@@ -32,10 +40,11 @@ typedef struct net_reply net_reply_t;
 
 /* struct net_info_s net_info; */
 
-net_info_t * net_init();
+net_info_t * net_init(const char *mnet, int mtu);
 
 /* functions */
 void net_tx(net_info_t *net, net_reply_t *reply);
+void net_txv(net_info_t *net, struct iovec *iov, int count);
 int net_rx(net_info_t * net, net_request_t *request);
 	
 /* network to host byte order */
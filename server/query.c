@@ -15,15 +15,53 @@
 #include <linux/types.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define DNBD_USERSPACE		1
 #include "../common/dnbd-cliserv.h"
 
 #include "query.h"
+#include "lz4.h"
 
 /* number of threads used to service requests */
 #define NUM_HANDLER_THREADS	1		/* default */
 #define MAX_BLOCK_SIZE		4096
+#define MAX_XFER_SIZE		DNBD_XFER_MAX
+/* reject read requests above this fill level (percent of max_queries) */
+#define QUERY_BUSY_LEVEL	90
+/* size of client table, must not be less than max_queries */
+#define QUERY_CLIENTS		128
+/* bytes added to the deficit of a client per round, one block */
+#define QUERY_QUANTUM		MAX_BLOCK_SIZE
+/* slot of a block in cache of compressed blocks */
+#define QUERY_ZBLOCK_HASH(pos, size) \
+	((((pos) >> 9) ^ (size)) * 2654435761U)
+/* reads of 4 KiB faster than this did not touch the disk */
+#define QUERY_HIT_USEC		50
+/* requests of a client found in the trace before blocks are pushed */
+#define QUERY_TRACE_MATCH	3
+/* entries of the trace searched for a request */
+#define QUERY_TRACE_WINDOW	64
+/* entries of the trace pushed ahead of a client */
+#define QUERY_TRACE_AHEAD	32
+/* seconds until an entry is pushed again for another client */
+#define QUERY_TRACE_AGAIN	2
+/* sequential requests of a client until it is a stream */
+#define QUERY_MERGE_RUN		8
+/* maximum distance of a stream to an earlier one to catch up */
+#define QUERY_MERGE_GAP		((uint64_t) 64 << 20)
+/* bytes pushed ahead of a stream catching up */
+#define QUERY_MERGE_AHEAD	(1 << 20)
+/* seconds after which a stream is considered finished */
+#define QUERY_MERGE_IDLE	2
+/* datagrams remembered for repairs after NACKs */
+#define QUERY_SENT		4096
+/* ranges waiting to be pushed, more are dropped */
+#define QUERY_PUSHES		64
 
 struct query_thread {
 	query_info_t *query_info;
@@ -44,44 +82,333 @@ pthread_cond_t got_query = PTHREAD_COND_INITIALIZER;
 int num_queries = 0;		/* number of pending requests, initially none */
 int max_queries = 100;		/* this value should be high enough */
 
-query_t *queries = NULL;	/* head of linked list of requests. */
-int last_query = 0;		/* initial position in circular buffer */
-int next_query = 0;		
+query_t *queries = NULL;	/* preallocated requests */
+query_t *free_queries = NULL;	/* list of unused requests */
+
+query_client_t *clients = NULL;	/* table of known clients */
+query_client_t *lru_head = NULL;	/* most recently seen client */
+query_client_t *lru_tail = NULL;
+query_client_t *active_head = NULL;	/* clients with pending requests */
+query_client_t *active_tail = NULL;
+int active_clients = 0;
+
+/* recently handled read requests for burst avoidance */
+struct query_read {
+	uint64_t pos;
+	size_t len;
+	struct sockaddr_in client;
+	time_t time;
+};
+
+struct query_read *reads = NULL;
+int next_read = 0;
+
+/* compressed blocks for repeated replies */
+struct query_zblock {
+	uint64_t pos;
+	size_t size;		/* bytes of block */
+	size_t zlen;		/* compressed bytes, 0 if incompressible */
+	int hits;
+	unsigned char *data;
+};
+
+struct query_zblock *zblocks = NULL;
+int num_zblocks = 0;
+pthread_mutex_t zblock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* recently sent datagrams by sequence number */
+struct query_sent {
+	uint32_t seq;
+	uint64_t pos;
+	size_t size;		/* bytes of data, 0 if unused */
+	uint16_t cmd;		/* flags of reply without sequence number */
+	int repaired;		/* sent again already */
+};
+
+/* recorded accesses of a typical session, e.g. a boot */
+struct query_trace {
+	uint64_t pos;
+	size_t len;
+	time_t pushed;
+};
+
+struct query_trace *trace = NULL;
+int num_trace = 0;
+
+/* data pushed by a thread of its own, handlers only queue it */
+struct query_range {
+	uint64_t pos;
+	size_t len;
+};
+
+struct query_range pushes[QUERY_PUSHES];
+int push_head = 0;
+int num_pushes = 0;
+pthread_mutex_t push_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t got_push = PTHREAD_COND_INITIALIZER;
+
+struct query_sent *sent = NULL;
+uint32_t next_seq = 0;
+pthread_mutex_t sent_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 void query_handle(struct query_info *query_info, query_t * query);
 
+/*
+ * function query_client_find(): look up client of a request in LRU order
+ * returns: pointer to client or NULL if unknown
+ */
+static query_client_t *query_client_find(net_request_t * request)
+{
+	query_client_t *client;
+
+	for (client = lru_head; client; client = client->lru_next) {
+		if ((client->addr.sin_addr.s_addr ==
+		     request->client.sin_addr.s_addr)
+		    && (client->addr.sin_port == request->client.sin_port))
+			return client;
+	}
+
+	return NULL;
+}
+
+/*
+ * function query_client_get(): find client of a request or replace
+ *          least recently used idle client, move it to head of LRU list
+ * returns: pointer to client
+ */
+static query_client_t *query_client_get(net_request_t * request)
+{
+	query_client_t *client;
+
+	if (!(client = query_client_find(request))) {
+		/* 
+		   there are more clients than requests, so an idle
+		   client is always found 
+		 */
+		for (client = lru_tail; client->pending;
+		     client = client->lru_prev);
+
+		memcpy(&client->addr, &request->client,
+		       sizeof(client->addr));
+		client->deficit = 0;
+		client->caps = 0;
+		client->trace = 0;
+		client->matched = 0;
+		client->run = 0;
+		client->pushed = 0;
+	}
+
+	if (client == lru_head)
+		return client;
+
+	/* unlink client */
+	client->lru_prev->lru_next = client->lru_next;
+	if (client->lru_next)
+		client->lru_next->lru_prev = client->lru_prev;
+	else
+		lru_tail = client->lru_prev;
+
+	/* and insert as head */
+	client->lru_prev = NULL;
+	client->lru_next = lru_head;
+	lru_head->lru_prev = client;
+	lru_head = client;
+
+	return client;
+}
+
+/*
+ * function query_map(): check for a multi-block read request
+ * returns: 1 if request carries a block map, otherwise 0
+ */
+static inline int query_map(query_t * query)
+{
+	return ((query->request.len == sizeof(dnbd_request_map_t))
+		&& (ntohs(query->request.data.cmd) & DNBD_CMD_MAP) ? 1 : 0);
+}
+
+/*
+ * function query_map_blocks(): count requested blocks of a block map
+ */
+static inline int query_map_blocks(uint64_t map)
+{
+	int n;
+
+	for (n = 0; map; n++)
+		map &= map - 1;
+
+	return n;
+}
+
+/*
+ * function query_cost(): bytes needed to answer a request,
+ *          request is still in network byte order
+ */
+static inline int query_cost(query_t * query)
+{
+	dnbd_request_t *dnbd_request = (dnbd_request_t *) & query->request.data;
+	uint16_t cmd = ntohs(dnbd_request->cmd);
+	int len;
+
+	/* each lost datagram is sent again */
+	if ((cmd & DNBD_CMD_MASK) == DNBD_CMD_NACK)
+		return MAX_BLOCK_SIZE * (query_map(query) ?
+			query_map_blocks(ntohll(query->request.data.map)) : 1);
+
+	if ((cmd & DNBD_CMD_MASK) != DNBD_CMD_READ)
+		return sizeof(struct dnbd_reply_init_ext);
+
+	len = ntohs(dnbd_request->len);
+	if (cmd & DNBD_CMD_SECTORS)
+		len <<= 9;
+
+	if (query_map(query))
+		len *= query_map_blocks(ntohll(query->request.data.map));
+
+	return len;
+}
+
+/*
+ * function query_put(): add request to the queue of its client,
+ *          must be called with query_mutex held
+ */
+static void query_put(query_t * query)
+{
+	query_client_t *client = query_client_get(&query->request);
+
+	query->client = client;
+	query->caps = client->caps;
+	query->next = NULL;
+
+	if (client->tail)
+		client->tail->next = query;
+	else
+		client->head = query;
+	client->tail = query;
+
+	/* client becomes active */
+	if (!client->pending++) {
+		client->next = NULL;
+		if (active_tail)
+			active_tail->next = client;
+		else
+			active_head = client;
+		active_tail = client;
+		active_clients++;
+	}
+
+	/* increase total number of pending requests */
+	num_queries++;
+}
+
+/*
+ * function query_free(): return request to list of unused requests,
+ *          must be called with query_mutex held
+ */
+static inline void query_free(query_t * query)
+{
+	query->next = free_queries;
+	free_queries = query;
+}
+
+/*
+ * function query_busy(): admission control, answer read requests with a
+ *          busy reply when the server is (nearly) overloaded and the
+ *          client already got its fair share
+ * returns: 1 if the request must not be queued, otherwise 0
+ */
+static int query_busy(query_info_t * query_info, query_t * query, int full)
+{
+	int depth, pending, share;
+	uint16_t cmd, id;
+	query_client_t *client;
+	dnbd_request_t *dnbd_request;
+	dnbd_reply_busy_t dnbd_reply_busy;
+	net_reply_t reply;
+
+	pthread_mutex_lock(&query_mutex);
+	depth = num_queries;
+	client = query_client_find(&query->request);
+	pending = (client ? client->pending : 0);
+	share = max_queries / (active_clients + (pending ? 0 : 1));
+	pthread_mutex_unlock(&query_mutex);
+
+	if (!full && ((depth < max_queries * QUERY_BUSY_LEVEL / 100)
+		      || (pending < share)))
+		return 0;
+
+	/* request is still in network byte order */
+	dnbd_request = (dnbd_request_t *) & query->request.data;
+	cmd = ntohs(dnbd_request->cmd);
+	id = ntohs(dnbd_request->id);
+
+	if ((ntohl(dnbd_request->magic) != DNBD_MAGIC)
+	    || !(cmd & DNBD_CMD_CLI))
+		return 1;
+
+	/* init and heartbeat requests are cheap, keep them if possible */
+	if ((cmd & DNBD_CMD_MASK) != DNBD_CMD_READ)
+		return full;
+
+	/* the request is not for us anyway */
+	if (id && (id != query_info->id))
+		return 1;
+
+	/* tell the client to try another server */
+	dnbd_reply_busy.magic = htonl(DNBD_MAGIC);
+	dnbd_reply_busy.id = htons(query_info->id);
+	dnbd_reply_busy.cmd = htons(DNBD_CMD_BUSY | DNBD_CMD_SRV);
+	dnbd_reply_busy.pos = dnbd_request->pos;
+	dnbd_reply_busy.time = dnbd_request->time;
+	dnbd_reply_busy.depth = htons(depth);
+
+	reply.data = &dnbd_reply_busy;
+	reply.len = sizeof(dnbd_reply_busy);
+	net_tx(query_info->net_info, &reply);
+
+	return 1;
+}
+
 /* 
- * function query_add_loop(): add incoming requests to circular buffer 
+ * function query_add_loop(): add incoming requests to queues of clients
  */
 void *query_add_loop(void *data)
 {
 	int rc;
 	query_t *query;
+	query_t overflow;	/* receives requests while all are in use */
 	query_info_t *query_info = (query_info_t *) data;
 
-	int tmp_query;
+	int full;
 
 	while (1) {
 
 		rc = pthread_mutex_lock(&query_mutex);
-		tmp_query = (next_query + 1) % max_queries;
+		if ((query = free_queries))
+			free_queries = query->next;
 		rc = pthread_mutex_unlock(&query_mutex);
 
-		if (tmp_query == last_query)
-			continue;
-
-		query = &queries[next_query];
+		full = !query;
+		if (full)
+			query = &overflow;
 
 		/* loop until a proper request arrives */
 		while (!net_rx(query_info->net_info, &query->request)) {}
 
-		rc = pthread_mutex_lock(&query_mutex);
+		/* shed load early instead of letting clients time out */
+		if (query_busy(query_info, query, full)) {
+			if (full)
+				continue;
+			rc = pthread_mutex_lock(&query_mutex);
+			query_free(query);
+			rc = pthread_mutex_unlock(&query_mutex);
+			continue;
+		}
 
-		next_query = tmp_query;
+		rc = pthread_mutex_lock(&query_mutex);
 
-		/* increase total number of pending requests */
-		num_queries++;
+		query_put(query);
 
 		rc = pthread_mutex_unlock(&query_mutex);
 
@@ -91,27 +418,597 @@ void *query_add_loop(void *data)
 }
 
 /*
- * function: query_get(): fetch request from circular buffer
- * returns: pointer to request
+ * function: query_get(): fetch next request by deficit round robin,
+ *           must be called with query_mutex held
+ * returns: pointer to request or NULL if none is pending
  */
-query_t *query_get(pthread_mutex_t * p_mutex)
+query_t *query_get(void)
 {
-	int rc;		
+	int cost;
 	query_t *query;		/* pointer to request */
+	query_client_t *client;
+
+	while ((client = active_head)) {
+		query = client->head;
+		cost = query_cost(query);
+
+		/* client has to wait for next round */
+		if (client->deficit < cost) {
+			client->deficit += QUERY_QUANTUM;
+			if (client != active_tail) {
+				active_head = client->next;
+				client->next = NULL;
+				active_tail->next = client;
+				active_tail = client;
+			}
+			continue;
+		}
 
-	rc = pthread_mutex_lock(p_mutex);
+		client->deficit -= cost;
 
-	if (last_query == next_query)
-		return NULL;
+		/* dequeue request from client */
+		if (!(client->head = query->next))
+			client->tail = NULL;
+
+		/* client becomes idle */
+		if (!--client->pending) {
+			client->deficit = 0;
+			if (!(active_head = client->next))
+				active_tail = NULL;
+			active_clients--;
+		}
+
+		num_queries--;
+		/* return the request to the caller */
+		return query;
+	}
+
+	return NULL;
+}
+
+/*
+ * function query_recent(): check if another client requested the same
+ *          data during the last second and remember this request
+ * returns: 1 if request can be dropped, otherwise 0
+ */
+static int query_recent(query_t * query, uint64_t pos, size_t len)
+{
+	int i, n;
+	time_t timestamp = time(NULL);
+	int result = 0;
+
+	for (i = 1; i < max_queries; i++) {
+		n = (next_read + max_queries - i) % max_queries;
+
+		/* check only up to one second */
+		if (timestamp - reads[n].time > 1)
+			break;
+
+		/* someone requested the same data before? */
+		if ((reads[n].pos == pos) && (reads[n].len >= len)) {
+			/* was it the same client, then retransmit
+			   as the packet was probably lost, otherwise
+			   drop the request */
+			result =
+			    !((reads[n].client.sin_addr.s_addr ==
+			       query->request.client.sin_addr.s_addr)
+			      && (reads[n].client.sin_port ==
+				  query->request.client.sin_port));
+			break;
+		}
+	}
+
+	reads[next_read].pos = pos;
+	reads[next_read].len = len;
+	reads[next_read].time = timestamp;
+	memcpy(&reads[next_read].client, &query->request.client,
+	       sizeof(reads[next_read].client));
+	next_read = (next_read + 1) % max_queries;
+
+	return result;
+}
+
+/*
+ * function query_caps(): remember capabilities of a client,
+ *          which are used in replies to its requests
+ */
+static void query_caps(query_t * query, uint32_t caps)
+{
+	query_client_t *client;
+
+	pthread_mutex_lock(&query_mutex);
+	if ((client = query_client_find(&query->request))) {
+		client->caps = caps & DNBD_CAPS;
+		/* a new session starts */
+		if ((query->request.data.cmd & DNBD_CMD_MASK) ==
+		    DNBD_CMD_INIT) {
+			client->trace = 0;
+			client->matched = 0;
+		}
+	}
+	pthread_mutex_unlock(&query_mutex);
+}
+
+/*
+ * function query_zblock_get(): look up compressed block in cache
+ * returns: size of compressed block, 0 if it is not compressible,
+ *          -1 if it is not cached
+ */
+static int query_zblock_get(uint64_t pos, size_t size, void *zbuf)
+{
+	int result = -1;
+	struct query_zblock *zblock;
+
+	if (!num_zblocks)
+		return -1;
+
+	pthread_mutex_lock(&zblock_mutex);
+	zblock = &zblocks[QUERY_ZBLOCK_HASH(pos, size) % num_zblocks];
+	if ((zblock->size == size) && (zblock->pos == pos)) {
+		zblock->hits++;
+		memcpy(zbuf, zblock->data, zblock->zlen);
+		result = zblock->zlen;
+	}
+	pthread_mutex_unlock(&zblock_mutex);
+
+	return result;
+}
+
+/*
+ * function query_zblock_put(): remember compressed block, a block
+ *          which was hit before is only replaced after some misses
+ */
+static void query_zblock_put(uint64_t pos, size_t size, void *zbuf,
+			     size_t zlen)
+{
+	struct query_zblock *zblock;
+
+	if (!num_zblocks)
+		return;
+
+	pthread_mutex_lock(&zblock_mutex);
+	zblock = &zblocks[QUERY_ZBLOCK_HASH(pos, size) % num_zblocks];
+	if (zblock->hits > 0) {
+		zblock->hits--;
+	} else {
+		zblock->pos = pos;
+		zblock->size = size;
+		zblock->zlen = zlen;
+		memcpy(zblock->data, zbuf, zlen);
+	}
+	pthread_mutex_unlock(&zblock_mutex);
+}
+
+/*
+ * function query_lz4(): compress a datagram or take it from cache
+ * returns: size of compressed data, 0 if it would not be smaller
+ */
+static size_t query_lz4(void *buf, size_t size, uint64_t pos, void *zbuf)
+{
+	int zlen;
+
+	if ((zlen = query_zblock_get(pos, size, zbuf)) >= 0)
+		return zlen;
+
+	/* must save at least the additional length field */
+	zlen = lz4_compress(buf, size, zbuf,
+			   size - (sizeof(dnbd_reply_lz4_t) -
+				   sizeof(dnbd_reply_t)) - 1);
+
+	query_zblock_put(pos, size, zbuf, zlen);
+	return zlen;
+}
+
+/*
+ * function query_xor(): add data to parity, 16 bytes at once if possible
+ */
+static void query_xor(void *parity, const void *buf, size_t len)
+{
+	size_t i = 0;
+	unsigned char *p = parity;
+	const unsigned char *b = buf;
+
+#ifdef __SSE2__
+	for (; i + sizeof(__m128i) <= len; i += sizeof(__m128i))
+		_mm_storeu_si128((__m128i *) (p + i),
+				 _mm_xor_si128(_mm_loadu_si128
+					       ((__m128i *) (p + i)),
+					       _mm_loadu_si128((__m128i *)
+							       (b + i))));
+#endif
+	for (; i < len; i++)
+		p[i] ^= b[i];
+}
+
+/*
+ * function query_read(): read from underlying device/file and
+ *          measure service time for the load sent to clients
+ */
+static void query_read(query_info_t * query_info, void *buf, size_t size,
+		       uint64_t pos)
+{
+	struct timeval start, end;
+	int usec;
+
+	pthread_mutex_lock(&handler_mutex);
+	gettimeofday(&start, NULL);
+	filer_readblock(query_info->filer_info, buf, size, pos);
+	gettimeofday(&end, NULL);
+
+	usec = ((end.tv_sec - start.tv_sec) * 1000000
+		+ end.tv_usec - start.tv_usec) * MAX_BLOCK_SIZE / size;
+
+	query_info->service += (usec - query_info->service) / 8;
+	query_info->hits += ((usec < QUERY_HIT_USEC ? 100 << 8 : 0)
+			     - query_info->hits) / 16;
+	pthread_mutex_unlock(&handler_mutex);
+}
+
+/*
+ * function query_load(): current load of this server
+ */
+static void query_load(query_info_t * query_info,
+		       dnbd_trailer_load_t * load)
+{
+	load->depth = htons(num_queries);
+	load->service = htons(query_info->service > 0xffff ? 0xffff
+			      : query_info->service);
+	load->hits = query_info->hits >> 8;
+}
+
+/*
+ * function query_sent_add(): remember a datagram for repairs
+ * returns: its sequence number
+ */
+static uint32_t query_sent_add(uint64_t pos, size_t size, uint16_t cmd)
+{
+	uint32_t seq;
+	struct query_sent *entry;
+
+	pthread_mutex_lock(&sent_mutex);
+	seq = next_seq++;
+	entry = &sent[seq % QUERY_SENT];
+	entry->seq = seq;
+	entry->pos = pos;
+	entry->size = size;
+	entry->cmd = cmd;
+	entry->repaired = 0;
+	pthread_mutex_unlock(&sent_mutex);
+
+	return seq;
+}
+
+/*
+ * function query_reply_data(): send data of a read request, split into
+ *          datagrams which fit into a frame, followed by a parity
+ *          datagram for each group of datagrams if FEC is enabled,
+ *          query is NULL for data sent without a request
+ */
+static void query_reply_data(query_info_t * query_info,
+			     dnbd_reply_t * dnbd_reply, void *buf,
+			     size_t len, uint64_t pos, uint16_t cmd,
+			     query_t * query)
+{
+	struct iovec iov[5];
+	size_t size, zlen;
+	int n_iov;
+	dnbd_trailer_seq_t seq;
+	dnbd_trailer_seq_t seqs[DNBD_FEC_MAX];
+	dnbd_trailer_load_t load;
+	size_t datagram = query_info->net_info->datagram;
+	int count = (len + datagram - 1) / datagram;
+	int fec, groups, group = 0, n = 0;
+	unsigned char parity[datagram];
+	unsigned char zbuf[datagram];
+	dnbd_reply_fec_t dnbd_reply_fec;
+	dnbd_reply_lz4_t dnbd_reply_lz4;
+
+	/* groups of nearly equal number of datagrams */
+	groups = (query_info->fec ? (count + query_info->fec - 1)
+		  / query_info->fec : 0);
+
+	/* a single datagram is cheaper to request again */
+	fec = (groups && (count > 1));
+
+	do {
+		size = (len > datagram ? datagram : len);
+
+		/* each datagram tells its own position and sequence number */
+		dnbd_reply->pos = htonll(pos);
+		seq = htonl(query_sent_add(pos, size,
+					   (len > size ? cmd | DNBD_CMD_MORE :
+					    cmd) & ~DNBD_CMD_USEC));
+		dnbd_reply->cmd =
+		    htons((len > size ? cmd | DNBD_CMD_MORE : cmd)
+			  | DNBD_CMD_SEQ | DNBD_CMD_LOAD);
+
+		/* compress if the client can expand it and it saves space */
+		if (query_info->lz4 && query && (query->caps & DNBD_CAP_LZ4)
+		    && (zlen = query_lz4(buf, size, pos, zbuf))) {
+			dnbd_reply_lz4.magic = dnbd_reply->magic;
+			dnbd_reply_lz4.id = dnbd_reply->id;
+			dnbd_reply_lz4.time = dnbd_reply->time;
+			dnbd_reply_lz4.pos = dnbd_reply->pos;
+			dnbd_reply_lz4.cmd =
+			    htons((ntohs(dnbd_reply->cmd) & ~DNBD_CMD_MASK)
+				  | DNBD_CMD_LZ4);
+			dnbd_reply_lz4.len = htons(size);
+
+			iov[0].iov_base = &dnbd_reply_lz4;
+			iov[0].iov_len = sizeof(dnbd_reply_lz4);
+			iov[1].iov_base = zbuf;
+			iov[1].iov_len = zlen;
+		} else {
+			iov[0].iov_base = dnbd_reply;
+			iov[0].iov_len = sizeof(dnbd_reply_t);
+			iov[1].iov_base = buf;
+			iov[1].iov_len = size;
+		}
+		/* trailers in order of their flags */
+		iov[2].iov_base = &seq;
+		iov[2].iov_len = sizeof(seq);
+		n_iov = 3;
+		if (cmd & DNBD_CMD_USEC) {
+			iov[n_iov].iov_base = &query->request.usec;
+			iov[n_iov++].iov_len = sizeof(query->request.usec);
+		}
+		query_load(query_info, &load);
+		iov[n_iov].iov_base = &load;
+		iov[n_iov++].iov_len = sizeof(load);
+		net_txv(query_info->net_info, iov, n_iov);
+
+		if (fec) {
+			/* start new group */
+			if (!n++) {
+				group = (count + groups - 1) / groups;
+				count -= group;
+				groups--;
+
+				dnbd_reply_fec.magic = dnbd_reply->magic;
+				dnbd_reply_fec.id = dnbd_reply->id;
+				dnbd_reply_fec.time = dnbd_reply->time;
+				dnbd_reply_fec.pos = dnbd_reply->pos;
+				dnbd_reply_fec.count = htons(group);
+				dnbd_reply_fec.size = htonl(size);
+				dnbd_reply_fec.len = 0;
+
+				memset(parity, 0, size);
+			}
 
-	query = &queries[last_query];
+			query_xor(parity, buf, size);
+			seqs[n - 1] = seq;
+			dnbd_reply_fec.len =
+			    htonl(ntohl(dnbd_reply_fec.len) + size);
+
+			/* group complete, send parity */
+			if (n == group) {
+				dnbd_reply_fec.cmd =
+				    htons((ntohs(dnbd_reply->cmd) & DNBD_CMD_MORE)
+					  | DNBD_CMD_FEC | DNBD_CMD_SRV
+					  | DNBD_CMD_SEQ);
+
+				iov[0].iov_base = &dnbd_reply_fec;
+				iov[0].iov_len = sizeof(dnbd_reply_fec);
+				iov[1].iov_base = parity;
+				iov[1].iov_len = ntohl(dnbd_reply_fec.size);
+				/* recovered datagrams get their own again */
+				iov[2].iov_base = seqs;
+				iov[2].iov_len = n * sizeof(seq);
+				net_txv(query_info->net_info, iov, 3);
+				n = 0;
+			}
+		}
+
+		buf += size;
+		pos += size;
+		len -= size;
+	} while (len > 0);
+}
+
+/*
+ * function query_reply_run(): read contiguous blocks from the device
+ *          and send them as a single reply
+ */
+static void query_reply_run(query_info_t * query_info, query_t * query,
+			    uint64_t pos, size_t len, uint16_t cmd)
+{
+	int recent = 0;
+	size_t size;
+	dnbd_reply_t *dnbd_reply = (dnbd_reply_t *) query->reply.data;
+	void *buf = (void *) dnbd_reply + sizeof(dnbd_reply_t);
+
+	/* burst avoidance */
+	pthread_mutex_lock(&query_mutex);
+	recent = query_recent(query, pos, len);
+	pthread_mutex_unlock(&query_mutex);
+
+	if (recent)
+		return;
+
+	do {
+		size = (len > MAX_XFER_SIZE ? MAX_XFER_SIZE : len);
+
+		query_read(query_info, buf, size, pos);
 
-	last_query = (last_query + 1) % max_queries;
-	num_queries--;
+		query->reply.len = size + sizeof(dnbd_reply_t);
 
-	rc = pthread_mutex_unlock(p_mutex);
-	/* return the request to the caller */
-	return query;
+		/* send reply, the run continues in next chunk */
+		query_reply_data(query_info, dnbd_reply, buf, size, pos,
+				 (len > size ? cmd | DNBD_CMD_MORE : cmd),
+				 query);
+
+		pos += size;
+		len -= size;
+	} while (len > 0);
+}
+
+/*
+ * function query_repair(): send a lost datagram again, only once
+ *          if several clients missed it
+ */
+static void query_repair(query_info_t * query_info, query_t * query,
+			 uint32_t seq)
+{
+	uint64_t pos = 0;
+	size_t size = 0;
+	uint16_t cmd = 0;
+	struct query_sent *entry;
+	dnbd_reply_t *dnbd_reply = (dnbd_reply_t *) query->reply.data;
+	void *buf = (void *) dnbd_reply + sizeof(dnbd_reply_t);
+
+	pthread_mutex_lock(&sent_mutex);
+	entry = &sent[seq % QUERY_SENT];
+	if ((entry->seq == seq) && entry->size && !entry->repaired) {
+		entry->repaired = 1;
+		pos = entry->pos;
+		size = entry->size;
+		cmd = entry->cmd;
+	}
+	pthread_mutex_unlock(&sent_mutex);
+
+	/* unknown, too old or already repaired */
+	if (!size)
+		return;
+
+	query_read(query_info, buf, size, pos);
+
+	/* the repair gets a new sequence number */
+	query_reply_data(query_info, dnbd_reply, buf, size, pos,
+			 cmd | (query->request.data.cmd & DNBD_CMD_USEC),
+			 query);
+}
+
+/*
+ * function query_push(): queue data nobody asked for to be sent by
+ *          query_push_loop(), clients keep it in their cache
+ */
+static void query_push(uint64_t pos, size_t len)
+{
+	pthread_mutex_lock(&push_mutex);
+	if (num_pushes < QUERY_PUSHES) {
+		pushes[(push_head + num_pushes) % QUERY_PUSHES].pos = pos;
+		pushes[(push_head + num_pushes) % QUERY_PUSHES].len = len;
+		num_pushes++;
+		pthread_cond_signal(&got_push);
+	}
+	pthread_mutex_unlock(&push_mutex);
+}
+
+/*
+ * function query_trace(): follow a client through the trace and push
+ *          the blocks it will read next if it matches
+ */
+static void query_trace(query_t * query, uint64_t pos)
+{
+	int i;
+	time_t now = time(NULL);
+	query_client_t *client;
+
+	if (!num_trace)
+		return;
+
+	pthread_mutex_lock(&query_mutex);
+	if (!(client = query_client_find(&query->request)))
+		goto out;
+
+	for (i = client->trace; (i < num_trace)
+	     && (i < client->trace + QUERY_TRACE_WINDOW); i++) {
+		if ((pos >= trace[i].pos)
+		    && (pos < trace[i].pos + trace[i].len))
+			break;
+	}
+
+	if ((i >= num_trace) || (i >= client->trace + QUERY_TRACE_WINDOW))
+		goto out;
+
+	client->trace = i + 1;
+	if (++client->matched < QUERY_TRACE_MATCH)
+		goto out;
+
+	/* entries not pushed for another client just before */
+	for (i = client->trace; (i < num_trace)
+	     && (i < client->trace + QUERY_TRACE_AHEAD); i++) {
+		if (now - trace[i].pushed >= QUERY_TRACE_AGAIN) {
+			trace[i].pushed = now;
+			query_push(trace[i].pos, trace[i].len);
+		}
+	}
+      out:
+	pthread_mutex_unlock(&query_mutex);
+}
+
+/*
+ * function query_merge(): detect a sequential stream of a client
+ *          following an earlier one and push the data between both,
+ *          so the client reads the replies of the earlier stream from
+ *          its cache when it reaches them
+ */
+static void query_merge(query_t * query, uint64_t pos, uint64_t end)
+{
+	time_t now = time(NULL);
+	query_client_t *client, *other;
+	uint64_t ahead = 0, from = 0, to = 0;
+
+	pthread_mutex_lock(&query_mutex);
+	if (!(client = query_client_find(&query->request)))
+		goto out;
+
+	/* blocks found in cache are skipped */
+	if ((pos >= client->stream)
+	    && (pos < client->stream + QUERY_MERGE_GAP)
+	    && (now - client->streamed <= QUERY_MERGE_IDLE)) {
+		client->run++;
+	} else {
+		client->run = 0;
+		client->pushed = 0;
+	}
+	client->stream = end;
+	client->streamed = now;
+
+	if (client->run < QUERY_MERGE_RUN)
+		goto out;
+
+	/* nearest stream ahead */
+	for (other = lru_head; other; other = other->lru_next) {
+		if ((other == client) || (other->run < QUERY_MERGE_RUN)
+		    || (now - other->streamed > QUERY_MERGE_IDLE)
+		    || (other->stream <= end)
+		    || (other->stream - end > QUERY_MERGE_GAP))
+			continue;
+		if (!ahead || (other->stream < ahead))
+			ahead = other->stream;
+	}
+
+	if (!ahead)
+		goto out;
+
+	from = (client->pushed > end ? client->pushed : end);
+	to = (ahead - end > QUERY_MERGE_AHEAD ? end + QUERY_MERGE_AHEAD :
+	      ahead);
+	if (from < to)
+		client->pushed = to;
+      out:
+	pthread_mutex_unlock(&query_mutex);
+
+	if (from < to)
+		query_push(from, to - from);
+}
+
+/*
+ * function query_reply_init(): fill in parameters of this server
+ */
+static void query_reply_init(query_info_t * query_info,
+			     struct dnbd_reply_init_ext *dnbd_reply_init)
+{
+	dnbd_reply_init->magic = htonl(DNBD_MAGIC);
+	dnbd_reply_init->capacity =
+	    htonll(filer_getcapacity(query_info->filer_info));
+	dnbd_reply_init->blksize = htons(MAX_BLOCK_SIZE);
+	dnbd_reply_init->id = htons(query_info->id);
+	dnbd_reply_init->xfersize = htonl(MAX_XFER_SIZE);
+	dnbd_reply_init->version = htons(DNBD_PROTO_VERSION);
+	dnbd_reply_init->caps =
+	    htonl(query_info->lz4 ? DNBD_CAPS : DNBD_CAPS & ~DNBD_CAP_LZ4);
 }
 
 /*
@@ -119,19 +1016,20 @@ query_t *query_get(pthread_mutex_t * p_mutex)
  */
 void query_handle(struct query_info *query_info, query_t * query)
 {
-	int i, rc;
 	dnbd_request_t *dnbd_request;
-	dnbd_request_t *dnbd_old_request;
 	dnbd_reply_t *dnbd_reply = NULL;
-	struct dnbd_reply_init *dnbd_reply_init;
-	int tmp_query;
-	int recent = 0;
-	time_t timestamp;
+	struct dnbd_reply_init_ext *dnbd_reply_init;
+	uint64_t map;
+	size_t len;
+	int i, j;
 
 	dnbd_request = (dnbd_request_t *) & query->request.data;
 
 	query->reply.len = 0;
 
+	/* read requests ask for a single block or blocks from a map */
+	map = (query_map(query) ? ntohll(query->request.data.map) : 1);
+
 	/* convert data from network to host byte order */
 	dnbd_request->magic = ntohl(dnbd_request->magic);
 	dnbd_request->time = ntohs(dnbd_request->time);
@@ -157,72 +1055,55 @@ void query_handle(struct query_info *query_info, query_t * query)
 	/* handle heartbeat request */
 	case DNBD_CMD_HB:
 		dnbd_reply_init =
-		    (struct dnbd_reply_init *) query->reply.data;
-		dnbd_reply_init->magic = htonl(DNBD_MAGIC);
-
-		dnbd_reply_init->capacity =
-		    htonll(filer_getcapacity(query_info->filer_info));
+		    (struct dnbd_reply_init_ext *) query->reply.data;
+		query_reply_init(query_info, dnbd_reply_init);
 
 		dnbd_reply_init->cmd =
 		    htons((dnbd_request->cmd
 			   & ~DNBD_CMD_CLI) | DNBD_CMD_SRV);
+		dnbd_reply_init->time = htons(dnbd_request->time);
+
+		/* newer clients tell us their version and capabilities */
+		query_caps(query, (dnbd_request->cmd & DNBD_CMD_EXT)
+			   ? DNBD_EXT_CAPS(dnbd_request->pos) : 0);
+
+		/* 
+		   clients of version 0 check the size of init replies,
+		   only the kernel module receives heartbeat replies 
+		 */
+		if ((dnbd_request->cmd & DNBD_CMD_EXT)
+		    || ((dnbd_request->cmd & DNBD_CMD_MASK) == DNBD_CMD_HB))
+			query->reply.len = sizeof(struct dnbd_reply_init_ext);
+		else
+			query->reply.len = sizeof(struct dnbd_reply_init);
+
+		/* echo timestamp */
+		if (dnbd_request->cmd & DNBD_CMD_USEC) {
+			memcpy(query->reply.data + query->reply.len,
+			       &query->request.usec,
+			       sizeof(query->request.usec));
+			query->reply.len += sizeof(query->request.usec);
+		}
 
-		dnbd_reply_init->blksize = htons(MAX_BLOCK_SIZE);
-		dnbd_reply_init->id = htons(query_info->id);
-
-		query->reply.len = sizeof(struct dnbd_reply_init);
+		/* heartbeats tell clients our load */
+		if ((dnbd_request->cmd & DNBD_CMD_MASK) == DNBD_CMD_HB) {
+			dnbd_reply_init->cmd =
+			    htons(ntohs(dnbd_reply_init->cmd) | DNBD_CMD_LOAD);
+			query_load(query_info, (dnbd_trailer_load_t *)
+				   (query->reply.data + query->reply.len));
+			query->reply.len += sizeof(dnbd_trailer_load_t);
+		}
 
 		net_tx(query_info->net_info, &query->reply);
 		break;
 	/* handle read request */
 	case DNBD_CMD_READ:
-		timestamp = time(NULL);
-	
-		/* burst avoidance */
-		rc = pthread_mutex_lock(&query_mutex);
-		for (i = 2; i < max_queries; i++) {
-
-			tmp_query =
-			    (last_query + (max_queries - i)) % max_queries;
-				
-			if (tmp_query == last_query)
-				break;
-
-			/* check only up to one second */
-			if (!tmp_query
-			    || queries[tmp_query].time - timestamp > 1) {
-				break;
-			}
-			dnbd_old_request =
-			    (dnbd_request_t *) & queries[tmp_query].
-			    request.data;
-
-			/* someone requested the same block before? */
-			if (dnbd_request->pos == dnbd_old_request->pos) {
-				/* was it the same client, then retransmit
-				as the packet was probably lost, otherwise
-				drop the request */
-				if (!((query->request.clientlen ==
-				     queries[tmp_query].request.clientlen)
-				    &&
-				    (!memcmp
-				     (&query->request.client,
-				      &queries[tmp_query].request.client,
-				      query->request.clientlen)))) {
-					recent = 1;
-					break;
-				}
-				else
-					break;
-			}
-		} 
-		rc = pthread_mutex_unlock(&query_mutex);
-
-		if (recent)
-			break;
+		len = dnbd_request->len;
+		if (dnbd_request->cmd & DNBD_CMD_SECTORS)
+			len <<= 9;
 
 		/* size of request block too high? */
-		if (dnbd_request->len > MAX_BLOCK_SIZE)
+		if (!len || (len > MAX_XFER_SIZE))
 			break;
 
 		/* create a DNBD reply packet */
@@ -231,28 +1112,46 @@ void query_handle(struct query_info *query_info, query_t * query)
 		dnbd_reply->magic = htonl(DNBD_MAGIC);
 		dnbd_reply->time = htons(dnbd_request->time);
 		dnbd_reply->id = htons(query_info->id);
-		dnbd_reply->pos = htonll(dnbd_request->pos);
-
-		dnbd_reply->cmd =
-		    htons((dnbd_request->cmd
-			   & ~DNBD_CMD_CLI) | DNBD_CMD_SRV);
 
-		/* read from underlying device/file */
-		pthread_mutex_lock(&handler_mutex);
-		filer_readblock(query_info->filer_info,
-				(void *) dnbd_reply +
-				sizeof(struct dnbd_reply),
-				dnbd_request->len, dnbd_request->pos);
+		query->time = time(NULL);
 
-		pthread_mutex_unlock(&handler_mutex);
+		/* answer each run of contiguous blocks */
+		for (i = 0; i < DNBD_MAP_BLOCKS; i = j + 1) {
+			for (j = i; (j < DNBD_MAP_BLOCKS)
+			     && (map & ((uint64_t) 1 << j)); j++);
+
+			if (j > i)
+				query_reply_run(query_info, query,
+						dnbd_request->pos + i * len,
+						(j - i) * len,
+						(dnbd_request->cmd
+						 & ~(DNBD_CMD_CLI |
+						     DNBD_CMD_SECTORS |
+						     DNBD_CMD_MAP))
+						| DNBD_CMD_SRV);
+		}
 
-		query->reply.len =
-		    dnbd_request->len + sizeof(dnbd_reply_t);
+		/* push what the client will ask for next */
+		query_trace(query, dnbd_request->pos);
+		for (j = DNBD_MAP_BLOCKS; (j > 0)
+		     && !(map & ((uint64_t) 1 << (j - 1))); j--);
+		query_merge(query, dnbd_request->pos,
+			    dnbd_request->pos + j * len);
+		break;
+	/* handle datagrams lost by a client */
+	case DNBD_CMD_NACK:
+		dnbd_reply = (dnbd_reply_t *) query->reply.data;
 
-		query->time = time(NULL);
+		dnbd_reply->magic = htonl(DNBD_MAGIC);
+		dnbd_reply->time = htons(dnbd_request->time);
+		dnbd_reply->id = htons(query_info->id);
 
-		/* send reply */
-		net_tx(query_info->net_info, &query->reply);
+		/* bit i of map stands for sequence number pos + i */
+		for (i = 0; i < DNBD_MAP_BLOCKS; i++) {
+			if (map & ((uint64_t) 1 << i))
+				query_repair(query_info, query,
+					     (uint32_t) (dnbd_request->pos + i));
+		}
 		break;
 	}
 
@@ -276,20 +1175,16 @@ void *query_handle_loop(void *data)
 	/* do forever.... */
 	while (1) {
 
-		if (num_queries > 0) {	
-			/* a request is pending */
-			query = query_get(&query_mutex);
+		/* a request is pending? */
+		if ((query = query_get())) {
 
-			/* got a request? */
-			if (query) {	
-				
-				rc = pthread_mutex_unlock(&query_mutex);
-				/* handle request */
-				query_handle(query_thread[thread_id].
-					     query_info, query);
+			rc = pthread_mutex_unlock(&query_mutex);
+			/* handle request */
+			query_handle(query_thread[thread_id].
+				     query_info, query);
 
-				rc = pthread_mutex_lock(&query_mutex);
-			}
+			rc = pthread_mutex_lock(&query_mutex);
+			query_free(query);
 		} else {
 			/* wait for a request to arrive */
 			rc = pthread_cond_wait(&got_query, &query_mutex);
@@ -297,12 +1192,197 @@ void *query_handle_loop(void *data)
 	}
 }
 
+/*
+ * function query_carousel_loop(): send blocks of the device in a cycle
+ *          at a fixed rate, clients keep them in their cache
+ */
+void *query_carousel_loop(void *data)
+{
+	query_info_t *query_info = (query_info_t *) data;
+	unsigned char reply[MAX_XFER_SIZE + sizeof(dnbd_reply_t)];
+	dnbd_reply_t *dnbd_reply = (dnbd_reply_t *) reply;
+	void *buf = reply + sizeof(dnbd_reply_t);
+	uint64_t pos = query_info->start;
+	size_t size;
+
+	dnbd_reply->magic = htonl(DNBD_MAGIC);
+	dnbd_reply->id = htons(query_info->id);
+	dnbd_reply->time = 0;
+
+	while (1) {
+		size = (query_info->end - pos > MAX_XFER_SIZE ?
+			MAX_XFER_SIZE : query_info->end - pos);
+
+		query_read(query_info, buf, size, pos);
+		query_reply_data(query_info, dnbd_reply, buf, size, pos,
+				 DNBD_CMD_READ | DNBD_CMD_SRV |
+				 DNBD_CMD_PUSH, NULL);
+
+		if ((pos += size) >= query_info->end)
+			pos = query_info->start;
+
+		usleep((uint64_t) size * 1000000 / ((uint64_t)
+						    query_info->rate << 10));
+	}
+}
+
+/*
+ * function query_push_loop(): send data queued by query_push(), so
+ *          handlers are not kept from requests meanwhile
+ */
+void *query_push_loop(void *data)
+{
+	query_info_t *query_info = (query_info_t *) data;
+	unsigned char reply[MAX_XFER_SIZE + sizeof(dnbd_reply_t)];
+	dnbd_reply_t *dnbd_reply = (dnbd_reply_t *) reply;
+	void *buf = reply + sizeof(dnbd_reply_t);
+	uint64_t pos;
+	size_t len, size;
+
+	dnbd_reply->magic = htonl(DNBD_MAGIC);
+	dnbd_reply->id = htons(query_info->id);
+	dnbd_reply->time = 0;
+
+	while (1) {
+		pthread_mutex_lock(&push_mutex);
+		while (!num_pushes)
+			pthread_cond_wait(&got_push, &push_mutex);
+		pos = pushes[push_head].pos;
+		len = pushes[push_head].len;
+		push_head = (push_head + 1) % QUERY_PUSHES;
+		num_pushes--;
+		pthread_mutex_unlock(&push_mutex);
+
+		do {
+			size = (len > MAX_XFER_SIZE ? MAX_XFER_SIZE : len);
+			query_read(query_info, buf, size, pos);
+			query_reply_data(query_info, dnbd_reply, buf, size,
+					 pos, DNBD_CMD_READ | DNBD_CMD_SRV |
+					 DNBD_CMD_PUSH, NULL);
+			pos += size;
+			len -= size;
+		} while (len > 0);
+	}
+}
+
+/*
+ * function query_carousel_init(): start carousel over size bytes
+ *          from start, or up to end of device if size is 0
+ * returns: 1 on success, otherwise 0
+ */
+int query_carousel_init(query_info_t * query_info, int rate, uint64_t start,
+			uint64_t size)
+{
+	uint64_t capacity = filer_getcapacity(query_info->filer_info);
+
+	if ((rate <= 0) || (start >= capacity))
+		return 0;
+
+	query_info->rate = rate;
+	query_info->start = start;
+	query_info->end = (size && (size < capacity - start) ?
+			   start + size : capacity);
+
+	return (pthread_create(&query_info->c_thread, NULL,
+			       query_carousel_loop, (void *) query_info)
+		? 0 : 1);
+}
+
+/*
+ * function query_beacon_loop(): announce this server and its load
+ *          periodically, so clients need no heartbeat replies
+ */
+void *query_beacon_loop(void *data)
+{
+	query_info_t *query_info = (query_info_t *) data;
+	unsigned char beacon[sizeof(struct dnbd_reply_init_ext)
+			     + sizeof(dnbd_trailer_load_t)];
+	struct dnbd_reply_init_ext *dnbd_reply_init =
+	    (struct dnbd_reply_init_ext *) beacon;
+	net_reply_t reply;
+
+	reply.data = beacon;
+	reply.len = sizeof(beacon);
+
+	while (1) {
+		query_reply_init(query_info, dnbd_reply_init);
+		dnbd_reply_init->cmd =
+		    htons(DNBD_CMD_BEACON | DNBD_CMD_SRV | DNBD_CMD_PUSH |
+			  DNBD_CMD_LOAD);
+		dnbd_reply_init->time = 0;
+		query_load(query_info, (dnbd_trailer_load_t *)
+			   (beacon + sizeof(struct dnbd_reply_init_ext)));
+
+		net_tx(query_info->net_info, &reply);
+		sleep(query_info->beacon);
+	}
+}
+
+/*
+ * function query_beacon_init(): send beacons every interval seconds
+ * returns: 1 on success, otherwise 0
+ */
+int query_beacon_init(query_info_t * query_info, int interval)
+{
+	query_info->beacon = interval;
+
+	return (pthread_create(&query_info->b_thread, NULL,
+			       query_beacon_loop, (void *) query_info)
+		? 0 : 1);
+}
+
+/*
+ * function query_trace_init(): load trace of a session, a line per
+ *          access with position and length in bytes, accesses beyond
+ *          the device are skipped or cut at its end
+ * returns: number of entries, 0 on error
+ */
+int query_trace_init(filer_info_t * filer_info, const char *filename)
+{
+	FILE *file;
+	char line[128];
+	unsigned long long pos;
+	unsigned long len;
+	int size = 0;
+	struct query_trace *entries;
+	uint64_t capacity = filer_getcapacity(filer_info);
+
+	if (!(file = fopen(filename, "r")))
+		return 0;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%llu %lu", &pos, &len) != 2 || !len
+		    || (pos >= capacity))
+			continue;
+		if (len > capacity - pos)
+			len = capacity - pos;
+
+		if (num_trace == size) {
+			size = (size ? size * 2 : 1024);
+			if (!(entries = (struct query_trace *)
+			      realloc(trace, size * sizeof(*trace)))) {
+				fclose(file);
+				return 0;
+			}
+			trace = entries;
+		}
+
+		trace[num_trace].pos = pos;
+		trace[num_trace].len = len;
+		trace[num_trace].pushed = 0;
+		num_trace++;
+	}
+
+	fclose(file);
+	return num_trace;
+}
+
 /*
  * function query_init(): initialize request handling
  * returns: pointer to data structure query_info (see header file)
  */
 query_info_t *query_init(net_info_t * net_info, filer_info_t * filer_info,
-			 int id, int threads)
+			 int id, int threads, int fec, int lz4)
 {
 	int i;
 	query_info_t *query_info = NULL;
@@ -315,21 +1395,86 @@ query_info_t *query_init(net_info_t * net_info, filer_info_t * filer_info,
 	query_info->net_info = net_info;
 	query_info->filer_info = filer_info;
 	query_info->id = id;
+	query_info->fec = fec;
+	query_info->lz4 = (lz4 >= 0);
+	query_info->service = 0;
+	query_info->hits = 0;
 
 	if (!(queries = (query_t *) malloc(sizeof(query_t) * max_queries))) {
 		free(query_info);
 		return NULL;
 	}
 
-	last_query = 0;
-	next_query = 0;
+	if (!(reads = (struct query_read *)
+	      calloc(max_queries, sizeof(struct query_read)))) {
+		free(queries);
+		free(query_info);
+		return NULL;
+	}
 
-	/* reserve memory for circular buffer */
+	if (!(clients = (query_client_t *)
+	      calloc(QUERY_CLIENTS, sizeof(query_client_t)))) {
+		free(reads);
+		free(queries);
+		free(query_info);
+		return NULL;
+	}
+
+	if (!(sent = (struct query_sent *)
+	      calloc(QUERY_SENT, sizeof(struct query_sent)))) {
+		free(clients);
+		free(reads);
+		free(queries);
+		free(query_info);
+		return NULL;
+	}
+
+	/* cache of compressed blocks, lz4 is its size in MiB */
+	if (lz4 > 0) {
+		num_zblocks = ((size_t) lz4 << 20) / net_info->datagram;
+		if (!(zblocks = (struct query_zblock *)
+		      calloc(num_zblocks, sizeof(struct query_zblock)))) {
+			free(sent);
+			free(clients);
+			free(reads);
+			free(queries);
+			free(query_info);
+			return NULL;
+		}
+		for (i = 0; i < num_zblocks; i++) {
+			if (!(zblocks[i].data = malloc(net_info->datagram))) {
+				while (i--)
+					free(zblocks[i].data);
+				free(zblocks);
+				zblocks = NULL;
+				num_zblocks = 0;
+				free(sent);
+				free(clients);
+				free(reads);
+				free(queries);
+				free(query_info);
+				return NULL;
+			}
+		}
+	}
+
+	/* reserve memory for requests and put them to the free list */
+	free_queries = NULL;
 	for (i = 0; i < max_queries; i++) {
 		queries[i].reply.data =
-		    malloc(MAX_BLOCK_SIZE + sizeof(dnbd_reply_t));
+		    malloc(MAX_XFER_SIZE + sizeof(dnbd_reply_t));
+		query_free(&queries[i]);
 	}
 
+	/* chain clients in LRU list */
+	for (i = 0; i < QUERY_CLIENTS; i++) {
+		clients[i].lru_prev = (i ? &clients[i - 1] : NULL);
+		clients[i].lru_next =
+		    (i < QUERY_CLIENTS - 1 ? &clients[i + 1] : NULL);
+	}
+	lru_head = &clients[0];
+	lru_tail = &clients[QUERY_CLIENTS - 1];
+
 	/* create the request-handling threads */
 	for (i = 0; i < threads; i++) {
 
@@ -341,6 +1486,10 @@ query_info_t *query_init(net_info_t * net_info, filer_info_t * filer_info,
 			       (void *) &query_thread[i].id);
 	}
 
+	/* create thread for pushing data of traces and merged streams */
+	pthread_create(&query_info->t_thread, NULL,
+		       query_push_loop, (void *) query_info);
+
 	/* create thread for receiving network requests */
 	pthread_create(&query_info->p_thread, NULL,
 		       query_add_loop, (void *) query_info);
@@ -14,6 +14,17 @@ struct query_info {
 	net_info_t *net_info;
 	filer_info_t *filer_info;
 	int id;
+	int fec;		/* datagrams per parity, 0 if disabled */
+	int lz4;		/* compress replies if clients can expand */
+	int service;		/* average microseconds to read 4 KiB */
+	int hits;		/* percentage of fast reads << 8 */
+	pthread_t c_thread;	/* carousel */
+	int rate;		/* KiB per second of carousel */
+	uint64_t start;		/* bytes cycled through by carousel */
+	uint64_t end;
+	pthread_t b_thread;	/* beacons */
+	int beacon;		/* seconds between beacons */
+	pthread_t t_thread;	/* pushes of trace and merged streams */
 };
 
 typedef struct query_info query_info_t;
@@ -23,12 +34,41 @@ struct query {
 	time_t time;
 	net_request_t request;
 	net_reply_t reply;
+	struct query *next;		/* free list or queue of client */
+	struct query_client *client;
+	uint32_t caps;			/* capabilities of client */
 };
 
 typedef struct query query_t;
 
+/* state of a client for fair queuing (deficit round robin) */
+struct query_client {
+	struct sockaddr_in addr;
+	query_t *head;			/* pending requests of client */
+	query_t *tail;
+	int pending;
+	int deficit;			/* bytes client may be served */
+	uint32_t caps;			/* capabilities from handshake */
+	int trace;			/* next entry of trace expected */
+	int matched;			/* requests found in trace */
+	uint64_t stream;		/* end of last read request */
+	int run;			/* sequential read requests */
+	time_t streamed;		/* last sequential request */
+	uint64_t pushed;		/* end of data pushed to catch up */
+	struct query_client *next;	/* list of active clients */
+	struct query_client *lru_prev;	/* LRU list of all clients */
+	struct query_client *lru_next;
+};
+
+typedef struct query_client query_client_t;
+
 /* functions */
-query_info_t *query_init(net_info_t *, filer_info_t *, int id, int threads);
+query_info_t *query_init(net_info_t *, filer_info_t *, int id, int threads,
+			 int fec, int lz4);
+int query_carousel_init(query_info_t *, int rate, uint64_t start,
+			uint64_t size);
+int query_trace_init(filer_info_t *, const char *filename);
+int query_beacon_init(query_info_t *, int interval);
 
 /* host to network byte order */
 #include <endian.h>
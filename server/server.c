@@ -40,12 +40,30 @@ void server_help(void)
 	fprintf(stderr, "dnbd-server, version %s\n", DNBD_VERSION);
 	fprintf(stderr,
 		"Usage: dnbd-server -m <address> -d <device/file> -i <number>\n");
+	fprintf(stderr,
+		"                  [-t <threads>] [-M <mtu>] [-F <datagrams>]\n");
+	fprintf(stderr,
+		"                  [-Z <cache size>] [-C <rate>[:<start>:<size>]]\n");
+	fprintf(stderr,
+		"                  [-T <trace>] [-B <seconds>]\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "description:\n");
 	fprintf(stderr, "  -m|--mcast     <multicast-address>\n");
 	fprintf(stderr, "  -d|--device    <block device or file>\n");
 	fprintf(stderr, "  -i|--id        <unique identification number>\n");
 	fprintf(stderr, "  -t|--threads   <number of threads>\n");
+	fprintf(stderr, "  -M|--mtu       <MTU of network, default %i>\n",
+		NET_MTU);
+	fprintf(stderr, "  -F|--fec       <datagrams per parity datagram, "
+		"2-%i, default off>\n", DNBD_FEC_MAX);
+	fprintf(stderr, "  -Z|--lz4       <MiB of compressed blocks cached, "
+		"default no compression>\n");
+	fprintf(stderr, "  -C|--carousel  <KiB per second>[:<start MiB>:"
+		"<size MiB>], send device in a cycle\n");
+	fprintf(stderr, "  -T|--trace     <file with position and length "
+		"of reads in a session>\n");
+	fprintf(stderr, "  -B|--beacon    <seconds between beacons, "
+		"default %i, 0 disables>\n", SERVER_BEACON);
 }
 
 /*
@@ -68,6 +86,9 @@ server_info_t *server_init(int argc, char **argv)
 	memset(server_info, 0, sizeof(server_info_t));
 	
 	server_info->threads = 1;
+	server_info->mtu = NET_MTU;
+	server_info->lz4 = -1;
+	server_info->beacon = SERVER_BEACON;
 
 	/* return value for getopt */
 	int c;
@@ -79,12 +100,18 @@ server_info_t *server_init(int argc, char **argv)
 			{"device", required_argument, 0, 'd'},
 			{"threads", required_argument, 0, 't'},
 			{"id", required_argument, 0, 'i'},
+			{"mtu", required_argument, 0, 'M'},
+			{"fec", required_argument, 0, 'F'},
+			{"lz4", required_argument, 0, 'Z'},
+			{"carousel", required_argument, 0, 'C'},
+			{"trace", required_argument, 0, 'T'},
+			{"beacon", required_argument, 0, 'B'},
 			{0, 0, 0, 0}
 		};
 		/* option index for getopt_long */
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "vm:d:i:t:",
+		c = getopt_long(argc, argv, "vm:d:i:t:M:F:Z:C:T:B:",
 				long_options, &option_index);
 
 		/* at end of options? */
@@ -118,6 +145,49 @@ server_info_t *server_init(int argc, char **argv)
 				cmd = -1;
 			}
 			break;
+		case 'M':
+			if ((sscanf(optarg, "%u", &server_info->mtu) != 1)
+			    || (server_info->mtu < 576)
+			    || (server_info->mtu > 65535)) {
+				fprintf(stderr,"ERROR: MTU is wrong (576-65535)\n");
+				cmd = -1;
+			}
+			break;
+		case 'F':
+			if ((sscanf(optarg, "%u", &server_info->fec) != 1)
+			    || (server_info->fec < 2)
+			    || (server_info->fec > DNBD_FEC_MAX)) {
+				fprintf(stderr,"ERROR: FEC ratio is wrong (2-%i)\n",
+					DNBD_FEC_MAX);
+				cmd = -1;
+			}
+			break;
+		case 'Z':
+			if ((sscanf(optarg, "%u", &server_info->lz4) != 1)
+			    || (server_info->lz4 < 0)
+			    || (server_info->lz4 > 4096)) {
+				fprintf(stderr,"ERROR: Cache size is wrong (0-4096)\n");
+				cmd = -1;
+			}
+			break;
+		case 'C':
+			if ((sscanf(optarg, "%u:%u:%u", &server_info->carousel,
+				    &server_info->carousel_start,
+				    &server_info->carousel_size) < 1)
+			    || (server_info->carousel <= 0)) {
+				fprintf(stderr,"ERROR: Carousel rate is wrong (>0)\n");
+				cmd = -1;
+			}
+			break;
+		case 'T':
+			server_info->trace = optarg;
+			break;
+		case 'B':
+			if (sscanf(optarg, "%u", &server_info->beacon) != 1) {
+				fprintf(stderr,"ERROR: Beacon interval is wrong (>=0)\n");
+				cmd = -1;
+			}
+			break;
 
 		default:
 			cmd = -1;
@@ -176,7 +246,7 @@ int main(int argc, char **argv)
 	}
 
 	/* initialize network configuration and start listener thread */
-	if (!(server_info->net_info = net_init(server_info->mnet))) {
+	if (!(server_info->net_info = net_init(server_info->mnet, server_info->mtu))) {
 		fprintf(stderr, "ERROR: Initializing net!\n");
 		goto out_net;
 	}
@@ -186,15 +256,39 @@ int main(int argc, char **argv)
 		goto out_filer;
 	}
 
+	if (server_info->trace
+	    && !query_trace_init(server_info->filer_info,
+				 server_info->trace)) {
+		fprintf(stderr, "ERROR: Loading trace!\n");
+		goto out_query;
+	}
+
 	/* initialize threads to handle requests */
 	if (!
 	    (server_info->query_info =
 	     query_init(server_info->net_info, server_info->filer_info,
-			server_info->id, server_info->threads))) {
+			server_info->id, server_info->threads,
+			server_info->fec, server_info->lz4))) {
 		fprintf(stderr, "ERROR: Initializing query!\n");
 		goto out_query;
 	}
 
+	if (server_info->carousel
+	    && !query_carousel_init(server_info->query_info,
+				    server_info->carousel,
+				    (uint64_t) server_info->carousel_start << 20,
+				    (uint64_t) server_info->carousel_size << 20)) {
+		fprintf(stderr, "ERROR: Initializing carousel!\n");
+		goto out_query;
+	}
+
+	if (server_info->beacon
+	    && !query_beacon_init(server_info->query_info,
+				  server_info->beacon)) {
+		fprintf(stderr, "ERROR: Initializing beacons!\n");
+		goto out_query;
+	}
+
 	while (running)
 		pause();
 	
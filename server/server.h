@@ -5,11 +5,22 @@
 #include "net.h"
 #include "query.h"
 
+/* default seconds between beacons */
+#define SERVER_BEACON		1
+
 /* server relevant information mainly given by command line */
 struct server_info {
 	const char *filename;
 	int id;
 	int threads;
+	int mtu;
+	int fec;
+	int lz4;
+	int carousel;		/* KiB per second, 0 if disabled */
+	unsigned int carousel_start;	/* MiB */
+	unsigned int carousel_size;	/* MiB, 0 up to end of device */
+	const char *trace;	/* accesses of a session to be pushed */
+	int beacon;		/* seconds between beacons, 0 if disabled */
 	const char *mnet;
 	filer_info_t *filer_info;
 	net_info_t *net_info;